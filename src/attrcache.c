@@ -0,0 +1,251 @@
+/*
+ * attrcache.c - In-memory stat cache
+ *
+ * Copyright 2008 Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include "stdafx.h"
+#include "attrcache.h"
+
+/* Media players stat the same handful of files over and over, and every
+ * one of those is a round trip over the network. We remember the results
+ * (including 'file not found') for a little while, split across a bunch
+ * of independently locked tables so FUSE threads don't all pile up on one
+ * lock. An entry is also thrown out if its parent directory has been
+ * re-stat'ed with a different mtime or ctime, since that means something
+ * in the directory was added, removed, or renamed. Same as the directory
+ * cache, if the parent changed in the same second we looked at it, a
+ * second change wouldn't show up; then any re-stat of the parent counts */
+
+#define ATTRCACHE_SHARDS 		16
+#define ATTRCACHE_MAX_PER_SHARD 	(64 * 1024)
+
+struct AttrEntry {
+	struct stat st;
+	int err;
+	gint64 seen;
+	gint64 expires;
+
+	gboolean has_parent;
+	gboolean parent_racy;
+	gint64 parent_seen;
+	time_t parent_mtime;
+	long parent_mtime_nsec;
+	time_t parent_ctime;
+	long parent_ctime_nsec;
+};
+
+struct AttrCacheShard {
+	GHashTable* table;
+	GStaticMutex lock;
+};
+
+struct AttrCache {
+	gint64 ttl;
+	gint64 negative_ttl;
+	struct AttrCacheShard shards[ATTRCACHE_SHARDS];
+};
+
+static gint64 now_usec(void)
+{
+	GTimeVal t;
+	g_get_current_time(&t);
+	return (gint64)t.tv_sec * G_USEC_PER_SEC + t.tv_usec;
+}
+
+static void stat_times(const struct stat* st, long* mtime_nsec, long* ctime_nsec)
+{
+#ifdef HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+	*mtime_nsec = st->st_mtim.tv_nsec;
+	*ctime_nsec = st->st_ctim.tv_nsec;
+#else
+	*mtime_nsec = *ctime_nsec = 0;
+#endif
+}
+
+static gboolean parent_unchanged(const struct AttrEntry* entry, const struct AttrEntry* parent)
+{
+	long mtime_nsec, ctime_nsec;
+	stat_times(&parent->st, &mtime_nsec, &ctime_nsec);
+
+	if (entry->parent_racy && parent->seen != entry->parent_seen)
+		return FALSE;
+	return (entry->parent_mtime == parent->st.st_mtime && entry->parent_mtime_nsec == mtime_nsec &&
+		entry->parent_ctime == parent->st.st_ctime && entry->parent_ctime_nsec == ctime_nsec);
+}
+
+static struct AttrCacheShard* shard_for_path(struct AttrCache* this, const char* path)
+{
+	return &this->shards[g_str_hash(path) % ATTRCACHE_SHARDS];
+}
+
+static gboolean is_expired_item(gpointer key, gpointer val, gpointer now)
+{
+	return ((struct AttrEntry*)val)->expires <= *((gint64*)now);
+}
+
+static gboolean lookup_entry(struct AttrCache* this, const char* path, struct AttrEntry* out)
+{
+	struct AttrCacheShard* shard = shard_for_path(this, path);
+	struct AttrEntry* entry;
+	gboolean ret = FALSE;
+
+	g_static_mutex_lock(&shard->lock);
+	if ( (entry = g_hash_table_lookup(shard->table, path)) ) {
+		if (entry->expires > now_usec()) {
+			*out = *entry;
+			ret = TRUE;
+		} else {
+			g_hash_table_remove(shard->table, path);
+		}
+	}
+	g_static_mutex_unlock(&shard->lock);
+
+	return ret;
+}
+
+static void insert_entry(struct AttrCache* this, const char* path, struct AttrEntry* entry)
+{
+	struct AttrCacheShard* shard = shard_for_path(this, path);
+	struct AttrEntry parent;
+
+	/* Remember what the parent directory looked like when we saw this.
+	 * NOTE: The parent was stat'ed a little before it got here, so
+	 * anything within a second of that counts as racy */
+	char* parent_path = g_path_get_dirname(path);
+	entry->seen = now_usec();
+	if (strcmp(parent_path, path) && lookup_entry(this, parent_path, &parent) && parent.err == 0) {
+		time_t parent_seen_secs = parent.seen / G_USEC_PER_SEC;
+		entry->has_parent = TRUE;
+		entry->parent_seen = parent.seen;
+		entry->parent_mtime = parent.st.st_mtime;
+		entry->parent_ctime = parent.st.st_ctime;
+		stat_times(&parent.st, &entry->parent_mtime_nsec, &entry->parent_ctime_nsec);
+		entry->parent_racy = (parent.st.st_mtime + 1 >= parent_seen_secs || 
+				      parent.st.st_ctime + 1 >= parent_seen_secs);
+	}
+	g_free(parent_path);
+
+	g_static_mutex_lock(&shard->lock);
+
+	/* If we've gotten too big, try to trim out stale stuff; if that
+	 * doesn't help, just start over */
+	if (g_hash_table_size(shard->table) >= ATTRCACHE_MAX_PER_SHARD) {
+		gint64 now = now_usec();
+		g_hash_table_foreach_remove(shard->table, is_expired_item, &now);
+		if (g_hash_table_size(shard->table) >= ATTRCACHE_MAX_PER_SHARD)
+			g_hash_table_remove_all(shard->table);
+	}
+
+	g_hash_table_replace(shard->table, g_strdup(path), g_memdup(entry, sizeof(struct AttrEntry)));
+	g_static_mutex_unlock(&shard->lock);
+}
+
+struct AttrCache* attr_cache_new(guint ttl_secs, guint negative_ttl_secs)
+{
+	struct AttrCache* ret = g_new0(struct AttrCache, 1);
+	if (!ret)
+		return NULL;
+
+	ret->ttl = (gint64)ttl_secs * G_USEC_PER_SEC;
+	ret->negative_ttl = (gint64)negative_ttl_secs * G_USEC_PER_SEC;
+
+	int i;
+	for(i=0; i < ATTRCACHE_SHARDS; i++) {
+		ret->shards[i].table = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+		g_static_mutex_init(&ret->shards[i].lock);
+	}
+
+	return ret;
+}
+
+void attr_cache_free(struct AttrCache* this)
+{
+	if (!this)
+		return;
+
+	int i;
+	for(i=0; i < ATTRCACHE_SHARDS; i++) {
+		g_hash_table_destroy(this->shards[i].table);
+		g_static_mutex_free(&this->shards[i].lock);
+	}
+	g_free(this);
+}
+
+gboolean attr_cache_lookup(struct AttrCache* this, const char* path, struct stat* st, int* err)
+{
+	struct AttrEntry entry, parent;
+	if (!this || !lookup_entry(this, path, &entry))
+		return FALSE;
+
+	/* If the directory has changed since we saw this, don't trust it */
+	if (entry.has_parent) {
+		char* parent_path = g_path_get_dirname(path);
+		gboolean stale = (lookup_entry(this, parent_path, &parent) &&
+				  parent.err == 0 && !parent_unchanged(&entry, &parent));
+		g_free(parent_path);
+
+		if (stale) {
+			attr_cache_invalidate(this, path);
+			return FALSE;
+		}
+	}
+
+	if (st && entry.err == 0)
+		*st = entry.st;
+	if (err)
+		*err = entry.err;
+	return TRUE;
+}
+
+void attr_cache_insert(struct AttrCache* this, const char* path, const struct stat* st)
+{
+	struct AttrEntry entry;
+	if (!this || !this->ttl)
+		return;
+
+	memset(&entry, 0, sizeof(entry));
+	entry.st = *st;
+	entry.expires = now_usec() + this->ttl;
+	insert_entry(this, path, &entry);
+}
+
+void attr_cache_insert_negative(struct AttrCache* this, const char* path)
+{
+	struct AttrEntry entry;
+	if (!this || !this->negative_ttl)
+		return;
+
+	memset(&entry, 0, sizeof(entry));
+	entry.err = -ENOENT;
+	entry.expires = now_usec() + this->negative_ttl;
+	insert_entry(this, path, &entry);
+}
+
+void attr_cache_invalidate(struct AttrCache* this, const char* path)
+{
+	if (!this)
+		return;
+
+	struct AttrCacheShard* shard = shard_for_path(this, path);
+	g_static_mutex_lock(&shard->lock);
+	g_hash_table_remove(shard->table, path);
+	g_static_mutex_unlock(&shard->lock);
+}
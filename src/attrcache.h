@@ -0,0 +1,38 @@
+/*
+ * attrcache.h - Userspace video caching filesystem
+ *
+ * Copyright 2008 Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef _ATTRCACHE_H
+#define _ATTRCACHE_H
+
+#include "stdafx.h"
+
+struct AttrCache;
+
+struct AttrCache* attr_cache_new(guint ttl_secs, guint negative_ttl_secs);
+void attr_cache_free(struct AttrCache* this);
+gboolean attr_cache_lookup(struct AttrCache* this, const char* path, struct stat* st, int* err);
+void attr_cache_insert(struct AttrCache* this, const char* path, const struct stat* st);
+void attr_cache_insert_negative(struct AttrCache* this, const char* path);
+void attr_cache_invalidate(struct AttrCache* this, const char* path);
+
+#endif
@@ -0,0 +1,924 @@
+/*
+ * blockcache.c - Sparse, block-granular file cache
+ *
+ * Copyright 2008 Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include "stdafx.h"
+#include "blockcache.h"
+
+/* Every cached file is stored as two files named after the MD5 of its
+ * relative path: a sparse '.data' file where block n lives at offset
+ * n * block_size, and a '.map' file holding a header and a presence bitmap
+ * with one bit per block. Only blocks that have actually been read ever
+ * hit the disk, so a 20GB movie that was watched for 5 minutes costs 5
+ * minutes worth of disk.
+ *
+ * Blocks are grouped into extents, and the map also remembers when each
+ * extent was last read. Once the block cache gets too big, a background
+ * thread goes through every map and punches holes where the coldest
+ * extents were, so the parts of a movie people actually come back to
+ * stay, and the rest goes back to being read from the source */
+
+#define BLOCKMAP_MAGIC 	0x4d424356 	/* 'VCBM' */
+#define BLOCKMAP_VERSION 2
+
+/* How many blocks share an access time, and how often (in seconds) the
+ * reclaimer checks up on things if nobody pokes it */
+#define EXTENT_BLOCKS 		16
+#define RECLAIM_INTERVAL 	30
+
+struct BlockMapHeader {
+	guint32 magic;
+	guint32 version;
+	guint32 block_size;
+	guint32 reserved;
+	guint64 file_size;
+	gint64 	mtime;
+};
+
+struct BlockCache {
+	char* cache_root;
+	guint block_size;
+
+	/* Keyed by the MD5 of the relative path, same as the files */
+	GHashTable* open_files;
+	GStaticMutex open_files_lock;
+
+	/* How much is on disk; this drifts a little, and gets set straight
+	 * every time the reclaimer goes through the maps */
+	guint64 resident;
+	GStaticMutex usage_lock;
+
+	/* Background reclaim, between the watermarks */
+	GThread* reclaimer;
+	GMutex* reclaimer_lock;
+	GCond* reclaimer_cond;
+	gboolean reclaimer_quit;
+	guint64 high_watermark;
+	guint64 low_watermark;
+};
+
+struct BlockCacheFile {
+	gint refcnt;
+	struct BlockCache* parent;
+
+	char* key;
+	char* data_path;
+	char* map_path;
+	int data_fd;
+
+	guint64 file_size;
+	gint64 mtime;
+
+	/* Protected by lock; 'inflight' marks blocks someone is fetching right
+	 * now, and 'fetched' is signalled whenever one of them finishes */
+	guint64 block_count;
+	guint64 extent_count;
+	guint8* bitmap;
+	guint8* inflight;
+	guint32* access;
+	gboolean dirty;
+
+	/* Set once a newer version of the file has taken over our paths; we
+	 * keep serving our own (unlinked) data, but never save the map */
+	gboolean replaced;
+	GMutex* lock;
+	GCond* fetched;
+
+	/* Readers hold this while they read blocks out of the data file, so
+	 * nobody punches a hole under them */
+	GStaticRWLock data_lock;
+};
+
+/* A cold extent, as far as the reclaimer knows */
+struct ReclaimCandidate {
+	const char* key;
+	guint64 extent;
+	guint32 access;
+};
+
+enum BlockClaim {
+	BLOCK_PRESENT,
+	BLOCK_CLAIMED,
+	BLOCK_BUSY,
+};
+
+#define BIT_IS_SET(map, index) 	(((map)[(index) >> 3] & (1 << ((index) & 7))) != 0)
+#define BIT_SET(map, index) 	((map)[(index) >> 3] |= (1 << ((index) & 7)))
+#define BIT_CLEAR(map, index) 	((map)[(index) >> 3] &= ~(1 << ((index) & 7)))
+
+static size_t bitmap_size(guint64 block_count)
+{
+	return (size_t)((block_count + 7) / 8);
+}
+
+static guint64 extent_count_for(guint64 block_count)
+{
+	return (block_count + EXTENT_BLOCKS - 1) / EXTENT_BLOCKS;
+}
+
+static guint64 block_len(guint64 file_size, guint block_size, guint64 index)
+{
+	return MIN(block_size, file_size - index * block_size);
+}
+
+static guint64 extent_resident(const guint8* bitmap, guint64 file_size, guint block_size, guint64 block_count, guint64 extent)
+{
+	guint64 index, ret = 0;
+	for(index = extent * EXTENT_BLOCKS; index < MIN(block_count, (extent + 1) * EXTENT_BLOCKS); index++) {
+		if (BIT_IS_SET(bitmap, index))
+			ret += block_len(file_size, block_size, index);
+	}
+	return ret;
+}
+
+static void kick_reclaimer(struct BlockCache* this)
+{
+	if (!this->reclaimer)
+		return;
+
+	g_mutex_lock(this->reclaimer_lock);
+	g_cond_signal(this->reclaimer_cond);
+	g_mutex_unlock(this->reclaimer_lock);
+}
+
+static void usage_adjust(struct BlockCache* this, guint64 added, guint64 removed)
+{
+	gboolean over;
+
+	g_static_mutex_lock(&this->usage_lock);
+	this->resident += added;
+	this->resident -= MIN(removed, this->resident);
+	over = (this->high_watermark && this->resident > this->high_watermark);
+	g_static_mutex_unlock(&this->usage_lock);
+
+	if (over && added)
+		kick_reclaimer(this);
+}
+
+static enum BlockClaim block_claim(struct BlockCacheFile* file, guint64 index, gboolean wait, gboolean touch)
+{
+	/* Either the block's already here, or we become the one thread that
+	 * goes and gets it. If someone else is already getting it, we can
+	 * wait for them instead of asking the network twice */
+	enum BlockClaim ret;
+	g_mutex_lock(file->lock);
+
+	/* Remember that someone cares about this part of the file */
+	if (touch) {
+		guint32 now = time(NULL);
+		if (file->access[index / EXTENT_BLOCKS] != now) {
+			file->access[index / EXTENT_BLOCKS] = now;
+			file->dirty = TRUE;
+		}
+	}
+
+	while (wait && BIT_IS_SET(file->inflight, index))
+		g_cond_wait(file->fetched, file->lock);
+
+	if (BIT_IS_SET(file->bitmap, index)) {
+		ret = BLOCK_PRESENT;
+	} else if (BIT_IS_SET(file->inflight, index)) {
+		ret = BLOCK_BUSY;
+	} else {
+		BIT_SET(file->inflight, index);
+		ret = BLOCK_CLAIMED;
+	}
+
+	g_mutex_unlock(file->lock);
+	return ret;
+}
+
+static void block_release(struct BlockCacheFile* file, guint64 index, gboolean saved)
+{
+	g_mutex_lock(file->lock);
+	BIT_CLEAR(file->inflight, index);
+	if (saved) {
+		BIT_SET(file->bitmap, index);
+		file->dirty = TRUE;
+	}
+	g_cond_broadcast(file->fetched);
+	g_mutex_unlock(file->lock);
+
+	if (saved)
+		usage_adjust(file->parent, block_len(file->file_size, file->parent->block_size, index), 0);
+}
+
+
+/*
+ * Block map persistence
+ */
+
+static gboolean blockmap_read(const char* map_path, struct BlockMapHeader* h, guint8** bitmap, guint32** access)
+{
+	gboolean ret = FALSE;
+	guint64 block_count, extent_count;
+
+	*bitmap = NULL;
+	*access = NULL;
+
+	int fd = open(map_path, O_RDONLY);
+	if (fd < 0)
+		return FALSE;
+
+	if (read(fd, h, sizeof(*h)) != sizeof(*h) || h->magic != BLOCKMAP_MAGIC || 
+	    h->version != BLOCKMAP_VERSION || !h->block_size)
+		goto out;
+
+	block_count = (h->file_size + h->block_size - 1) / h->block_size;
+	extent_count = extent_count_for(block_count);
+	*bitmap = g_malloc0(bitmap_size(block_count) + 1);
+	*access = g_new0(guint32, extent_count + 1);
+
+	if (read(fd, *bitmap, bitmap_size(block_count)) != bitmap_size(block_count))
+		goto out;
+
+	if (read(fd, *access, extent_count * sizeof(guint32)) != extent_count * sizeof(guint32))
+		goto out;
+
+	ret = TRUE;
+
+out:
+	if (!ret) {
+		g_free(*bitmap);
+		g_free(*access);
+		*bitmap = NULL;
+		*access = NULL;
+	}
+	close(fd);
+	return ret;
+}
+
+static gboolean blockmap_load(struct BlockCacheFile* file)
+{
+	struct BlockMapHeader h;
+	guint8* bitmap;
+	guint32* access;
+	gboolean ret = FALSE;
+
+	if (!blockmap_read(file->map_path, &h, &bitmap, &access))
+		return FALSE;
+
+	/* If the source has changed underneath us, the blocks are junk */
+	if (h.block_size != file->parent->block_size ||
+	    h.file_size != file->file_size || h.mtime != file->mtime)
+		goto out;
+
+	memcpy(file->bitmap, bitmap, bitmap_size(file->block_count));
+	memcpy(file->access, access, file->extent_count * sizeof(guint32));
+	ret = TRUE;
+
+out:
+	g_free(bitmap);
+	g_free(access);
+	return ret;
+}
+
+static int blockmap_save_locked(struct BlockCacheFile* file)
+{
+	/* NOTE: Expects file->lock to be held */
+	struct BlockMapHeader h;
+	int ret = 0;
+	size_t len = bitmap_size(file->block_count);
+	size_t access_len = file->extent_count * sizeof(guint32);
+
+	if (!file->dirty || file->replaced)
+		return 0;
+
+	/* Make sure the data is on disk before we claim it is */
+	fsync(file->data_fd);
+
+	h.magic = BLOCKMAP_MAGIC;
+	h.version = BLOCKMAP_VERSION;
+	h.block_size = file->parent->block_size;
+	h.reserved = 0;
+	h.file_size = file->file_size;
+	h.mtime = file->mtime;
+
+	gchar* tmp_path = g_strdup_printf("%s.tmp", file->map_path);
+	int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		ret = -errno;
+		g_free(tmp_path);
+		goto out;
+	}
+
+	if (write(fd, &h, sizeof(h)) != sizeof(h) || write(fd, file->bitmap, len) != len ||
+	    write(fd, file->access, access_len) != access_len) {
+		ret = -EIO;
+		close(fd);
+		unlink(tmp_path);
+		g_free(tmp_path);
+		goto out;
+	}
+
+	close(fd);
+	if (rename(tmp_path, file->map_path) == 0)
+		file->dirty = FALSE;
+	else
+		ret = -errno;
+	g_free(tmp_path);
+
+out:
+	return ret;
+}
+
+static int blockmap_save(struct BlockCacheFile* file)
+{
+	int ret;
+	g_mutex_lock(file->lock);
+	ret = blockmap_save_locked(file);
+	g_mutex_unlock(file->lock);
+	return ret;
+}
+
+static int blockmap_reset(struct BlockCacheFile* file)
+{
+	/* Throw away the data, and recreate the file as one big hole. An
+	 * older version of the file may still have the old data open, so we
+	 * make a new file rather than truncating that one out from under it */
+	int ret = 0;
+	g_mutex_lock(file->lock);
+	memset(file->bitmap, 0, bitmap_size(file->block_count));
+	memset(file->access, 0, file->extent_count * sizeof(guint32));
+	unlink(file->map_path);
+	unlink(file->data_path);
+
+	close(file->data_fd);
+	if ((file->data_fd = open(file->data_path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) < 0) {
+		ret = -errno;
+	} else {
+		ftruncate(file->data_fd, file->file_size);
+	}
+	file->dirty = TRUE;
+	g_mutex_unlock(file->lock);
+
+	return ret;
+}
+
+
+/*
+ * BlockCacheFile
+ */
+
+static void block_cache_file_free(struct BlockCacheFile* file)
+{
+	if (!file)
+		return;
+
+	if (file->data_fd >= 0) {
+		blockmap_save(file);
+		close(file->data_fd);
+	}
+
+	g_free(file->bitmap);
+	g_free(file->inflight);
+	g_free(file->access);
+	g_mutex_free(file->lock);
+	g_cond_free(file->fetched);
+	g_static_rw_lock_free(&file->data_lock);
+	g_free(file->key);
+	g_free(file->data_path);
+	g_free(file->map_path);
+	g_free(file);
+}
+
+static struct BlockCacheFile* block_cache_file_new(struct BlockCache* parent, const char* key, guint64 file_size, gint64 mtime)
+{
+	struct BlockCacheFile* ret = g_new0(struct BlockCacheFile, 1);
+	ret->refcnt = 1;
+	ret->parent = parent;
+	ret->key = g_strdup(key);
+	ret->file_size = file_size;
+	ret->mtime = mtime;
+	ret->block_count = (ret->file_size + parent->block_size - 1) / parent->block_size;
+	ret->extent_count = extent_count_for(ret->block_count);
+	ret->bitmap = g_malloc0(bitmap_size(ret->block_count) + 1);
+	ret->inflight = g_malloc0(bitmap_size(ret->block_count) + 1);
+	ret->access = g_new0(guint32, ret->extent_count + 1);
+	ret->lock = g_mutex_new();
+	ret->fetched = g_cond_new();
+	g_static_rw_lock_init(&ret->data_lock);
+
+	gchar* base = g_build_filename(parent->cache_root, key, NULL);
+	ret->data_path = g_strdup_printf("%s.data", base);
+	ret->map_path = g_strdup_printf("%s.map", base);
+	g_free(base);
+
+	if ((ret->data_fd = open(ret->data_path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR)) < 0)
+		goto failed;
+
+	if (!blockmap_load(ret) && blockmap_reset(ret) < 0)
+		goto failed;
+
+	return ret;
+
+failed:
+	g_debug("Couldn't open block cache file '%s'", ret->data_path);
+	block_cache_file_free(ret);
+	return NULL;
+}
+
+static ssize_t block_cache_fetch(struct BlockCacheFile* file, int source_fd, guint64 index, char* block_buf, gboolean* saved)
+{
+	guint block_size = file->parent->block_size;
+	off_t block_offset = (off_t)index * block_size;
+	size_t len = MIN(block_size, file->file_size - block_offset);
+	size_t has_read = 0;
+
+	*saved = FALSE;
+	while (has_read < len) {
+		ssize_t tmp = pread(source_fd, block_buf + has_read, len - has_read, block_offset + has_read);
+		if (tmp < 0 && errno == EINTR)
+			continue;
+		if (tmp < 0)
+			return -1;
+		if (tmp == 0)
+			break;
+		has_read += tmp;
+	}
+
+	/* The source shrank - hand back what we've got, but don't save it */
+	if (has_read < len)
+		return has_read;
+
+	/* If the cache write fails (disk full, etc), we can still satisfy
+	 * the read, we just won't remember the block */
+	*saved = (pwrite(file->data_fd, block_buf, len, block_offset) == len);
+
+	return has_read;
+}
+
+
+/*
+ * Reclaiming cold extents
+ */
+
+static guint64 block_cache_file_punch(struct BlockCacheFile* file, guint64 extent, guint32 expected_access)
+{
+	guint64 ret = 0;
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+	guint block_size = file->parent->block_size;
+	guint64 first = extent * EXTENT_BLOCKS;
+	guint64 last = MIN(file->block_count, first + EXTENT_BLOCKS);
+	GArray* punched = g_array_new(FALSE, FALSE, sizeof(guint64));
+	guint64 index;
+	guint i;
+
+	/* Nobody can be reading blocks out of the data file while we do
+	 * this, and nobody can claim one until the map says it's gone */
+	g_static_rw_lock_writer_lock(&file->data_lock);
+	g_mutex_lock(file->lock);
+
+	/* If someone read it since we looked, it's not cold anymore */
+	if (file->access[extent] != expected_access)
+		goto out;
+
+	for(index = first; index < last; index++) {
+		if (!BIT_IS_SET(file->bitmap, index) || BIT_IS_SET(file->inflight, index))
+			continue;
+		BIT_CLEAR(file->bitmap, index);
+		g_array_append_val(punched, index);
+	}
+
+	/* The map has to say the blocks are gone before they actually are,
+	 * or a crash could leave us serving holes */
+	file->dirty = TRUE;
+	if (punched->len == 0 || blockmap_save_locked(file) < 0)
+		goto out;
+
+	for(i=0; i < punched->len; i++) {
+		index = g_array_index(punched, guint64, i);
+		guint64 len = block_len(file->file_size, block_size, index);
+		if (fallocate(file->data_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 
+					(off_t)index * block_size, len) == 0)
+			ret += len;
+	}
+
+out:
+	g_mutex_unlock(file->lock);
+	g_static_rw_lock_writer_unlock(&file->data_lock);
+	g_array_free(punched, TRUE);
+#endif
+	return ret;
+}
+
+static guint64 reclaim_candidate(struct BlockCache* this, struct ReclaimCandidate* candidate)
+{
+	/* NOTE: We punch through an open file, same as a reader would use, so
+	 * there's only ever one copy of the map in memory; the punch itself
+	 * (and the fsync that goes with it) happens without open_files_lock */
+	struct BlockCacheFile* file;
+	struct BlockMapHeader h;
+	guint8* bitmap;
+	guint32* access;
+	gboolean have_map;
+	guint64 ret = 0;
+
+	gchar* base = g_build_filename(this->cache_root, candidate->key, NULL);
+	gchar* map_path = g_strdup_printf("%s.map", base);
+	if ( (have_map = blockmap_read(map_path, &h, &bitmap, &access)) ) {
+		g_free(bitmap);
+		g_free(access);
+	}
+	g_free(map_path);
+	g_free(base);
+
+	g_static_mutex_lock(&this->open_files_lock);
+	if ( (file = g_hash_table_lookup(this->open_files, candidate->key)) ) {
+		g_atomic_int_inc(&file->refcnt);
+	} else if (have_map && h.block_size == this->block_size && 
+		   (file = block_cache_file_new(this, candidate->key, h.file_size, h.mtime)) ) {
+		g_hash_table_insert(this->open_files, file->key, file);
+	}
+	g_static_mutex_unlock(&this->open_files_lock);
+
+	if (file) {
+		ret = block_cache_file_punch(file, candidate->extent, candidate->access);
+		block_cache_close(file);
+	}
+	return ret;
+}
+
+static gint candidate_sortfunc(gconstpointer lhs, gconstpointer rhs)
+{
+	/* Coldest first */
+	guint32 lhs_t = ((const struct ReclaimCandidate*)lhs)->access;
+	guint32 rhs_t = ((const struct ReclaimCandidate*)rhs)->access;
+
+	if (lhs_t == rhs_t)
+		return 0;
+	return (lhs_t < rhs_t ? -1 : 1);
+}
+
+static guint64 scan_map(struct BlockCache* this, const char* key, GArray* candidates)
+{
+	/* Take a look at one file's map, from memory if it's open, or from
+	 * disk if it's not, and note down every extent that has anything */
+	struct BlockCacheFile* file;
+	struct BlockMapHeader h;
+	guint8* bitmap = NULL;
+	guint32* access = NULL;
+	guint64 block_count, extent, ret = 0;
+
+	g_static_mutex_lock(&this->open_files_lock);
+	if ( (file = g_hash_table_lookup(this->open_files, key)) ) {
+		g_mutex_lock(file->lock);
+		h.block_size = this->block_size;
+		h.file_size = file->file_size;
+		bitmap = g_memdup(file->bitmap, bitmap_size(file->block_count) + 1);
+		access = g_memdup(file->access, (file->extent_count + 1) * sizeof(guint32));
+		g_mutex_unlock(file->lock);
+	}
+	g_static_mutex_unlock(&this->open_files_lock);
+
+	if (!bitmap) {
+		gchar* base = g_build_filename(this->cache_root, key, NULL);
+		gchar* map_path = g_strdup_printf("%s.map", base);
+		gboolean loaded = blockmap_read(map_path, &h, &bitmap, &access);
+		g_free(map_path);
+		g_free(base);
+
+		if (!loaded)
+			return 0;
+		if (h.block_size != this->block_size)
+			goto out;
+	}
+
+	block_count = (h.file_size + h.block_size - 1) / h.block_size;
+	for(extent = 0; extent < extent_count_for(block_count); extent++) {
+		guint64 resident = extent_resident(bitmap, h.file_size, h.block_size, block_count, extent);
+		if (resident == 0)
+			continue;
+
+		struct ReclaimCandidate candidate = { key, extent, access[extent] };
+		g_array_append_val(candidates, candidate);
+		ret += resident;
+	}
+
+out:
+	g_free(bitmap);
+	g_free(access);
+	return ret;
+}
+
+guint64 block_cache_reclaim_space(struct BlockCache* this, guint64 high_watermark, guint64 low_watermark)
+{
+	GArray* candidates = g_array_new(FALSE, FALSE, sizeof(struct ReclaimCandidate));
+	GPtrArray* keys = g_ptr_array_new();
+	const gchar* entry;
+	guint64 total = 0, removed = 0;
+	guint i;
+
+	GDir* dir = g_dir_open(this->cache_root, 0, NULL);
+	if (!dir)
+		goto out;
+
+	/* Go through every map, and find out how much we're really using */
+	while ( (entry = g_dir_read_name(dir)) ) {
+		if (!g_str_has_suffix(entry, ".map"))
+			continue;
+
+		gchar* key = g_strndup(entry, strlen(entry) - strlen(".map"));
+		g_ptr_array_add(keys, key);
+		total += scan_map(this, key, candidates);
+	}
+	g_dir_close(dir);
+
+	g_static_mutex_lock(&this->usage_lock);
+	this->resident = total;
+	g_static_mutex_unlock(&this->usage_lock);
+
+	if (total <= high_watermark)
+		goto out;
+
+	/* Punch out the coldest extents until we're back under the low mark */
+	g_array_sort(candidates, candidate_sortfunc);
+	for(i=0; i < candidates->len && total - removed > low_watermark; i++)
+		removed += reclaim_candidate(this, &g_array_index(candidates, struct ReclaimCandidate, i));
+
+	usage_adjust(this, 0, removed);
+
+out:
+	for(i=0; i < keys->len; i++)
+		g_free(g_ptr_array_index(keys, i));
+	g_ptr_array_free(keys, TRUE);
+	g_array_free(candidates, TRUE);
+	return removed;
+}
+
+static gpointer reclaimer_thread(gpointer block_cache)
+{
+	struct BlockCache* this = block_cache;
+	GTimeVal wake_at;
+
+	/* We don't know how much is on disk until we've looked once */
+	block_cache_reclaim_space(this, this->high_watermark, this->low_watermark);
+
+	g_mutex_lock(this->reclaimer_lock);
+	while (!this->reclaimer_quit) {
+		g_get_current_time(&wake_at);
+		g_time_val_add(&wake_at, RECLAIM_INTERVAL * G_USEC_PER_SEC);
+		g_cond_timed_wait(this->reclaimer_cond, this->reclaimer_lock, &wake_at);
+		if (this->reclaimer_quit)
+			break;
+		g_mutex_unlock(this->reclaimer_lock);
+
+		g_static_mutex_lock(&this->usage_lock);
+		gboolean over = (this->resident > this->high_watermark);
+		g_static_mutex_unlock(&this->usage_lock);
+
+		if (over)
+			block_cache_reclaim_space(this, this->high_watermark, this->low_watermark);
+
+		g_mutex_lock(this->reclaimer_lock);
+	}
+	g_mutex_unlock(this->reclaimer_lock);
+
+	return NULL;
+}
+
+void block_cache_start_reclaimer(struct BlockCache* this, guint64 high_watermark, guint64 low_watermark)
+{
+	if (!this || this->reclaimer || !high_watermark)
+		return;
+
+	this->high_watermark = high_watermark;
+	this->low_watermark = MIN(low_watermark, high_watermark);
+	this->reclaimer_lock = g_mutex_new();
+	this->reclaimer_cond = g_cond_new();
+	this->reclaimer = g_thread_create(reclaimer_thread, this, TRUE, NULL);
+}
+
+static void stop_reclaimer(struct BlockCache* this)
+{
+	if (!this->reclaimer)
+		return;
+
+	g_mutex_lock(this->reclaimer_lock);
+	this->reclaimer_quit = TRUE;
+	g_cond_signal(this->reclaimer_cond);
+	g_mutex_unlock(this->reclaimer_lock);
+
+	g_thread_join(this->reclaimer);
+	g_mutex_free(this->reclaimer_lock);
+	g_cond_free(this->reclaimer_cond);
+	this->reclaimer = NULL;
+}
+
+
+/*
+ * Public functions
+ */
+
+struct BlockCache* block_cache_new(const char* cache_root, guint block_size)
+{
+	struct BlockCache* ret = g_new0(struct BlockCache, 1);
+	if (!ret || !block_size)
+		goto failed;
+
+	ret->cache_root = g_strdup(cache_root);
+	ret->block_size = block_size;
+	if (g_mkdir_with_parents(ret->cache_root, 5+7*8+7*8*8) != 0)
+		goto failed;
+
+	ret->open_files = g_hash_table_new(g_str_hash, g_str_equal);
+	g_static_mutex_init(&ret->open_files_lock);
+	g_static_mutex_init(&ret->usage_lock);
+
+	return ret;
+
+failed:
+	if (ret) {
+		g_free(ret->cache_root);
+		g_free(ret);
+	}
+	return NULL;
+}
+
+static void trash_open_file_item(gpointer key, gpointer val, gpointer dontcare)
+{
+	block_cache_file_free(val);
+}
+
+void block_cache_free(struct BlockCache* this)
+{
+	if (!this)
+		return;
+
+	stop_reclaimer(this);
+	g_hash_table_foreach(this->open_files, trash_open_file_item, NULL);
+	g_hash_table_destroy(this->open_files);
+	g_static_mutex_free(&this->open_files_lock);
+	g_static_mutex_free(&this->usage_lock);
+	g_free(this->cache_root);
+	g_free(this);
+}
+
+struct BlockCacheFile* block_cache_open(struct BlockCache* this, const char* relative_path, const struct stat* source_st)
+{
+	struct BlockCacheFile* ret;
+	if (!this || !source_st)
+		return NULL;
+
+	gchar* key = g_compute_checksum_for_string(G_CHECKSUM_MD5, relative_path, -1);
+	g_static_mutex_lock(&this->open_files_lock);
+
+	if ( (ret = g_hash_table_lookup(this->open_files, key)) ) {
+		/* If the file's changed since someone else opened it, start over */
+		if (ret->file_size != source_st->st_size || ret->mtime != source_st->st_mtime) {
+			g_mutex_lock(ret->lock);
+			ret->replaced = TRUE;
+			g_mutex_unlock(ret->lock);
+			g_hash_table_remove(this->open_files, ret->key);
+			ret = NULL;
+		} else {
+			g_atomic_int_inc(&ret->refcnt);
+		}
+	}
+
+	if (!ret && (ret = block_cache_file_new(this, key, source_st->st_size, source_st->st_mtime)) )
+		g_hash_table_insert(this->open_files, ret->key, ret);
+
+	g_static_mutex_unlock(&this->open_files_lock);
+	g_free(key);
+	return ret;
+}
+
+void block_cache_close(struct BlockCacheFile* file)
+{
+	if (!file)
+		return;
+
+	struct BlockCache* parent = file->parent;
+	g_static_mutex_lock(&parent->open_files_lock);
+	if (g_atomic_int_get(&file->refcnt) > 1) {
+		g_atomic_int_add(&file->refcnt, -1);
+		g_static_mutex_unlock(&parent->open_files_lock);
+		return;
+	}
+	g_static_mutex_unlock(&parent->open_files_lock);
+
+	/* The map has to be saved before we drop out of open_files, or the
+	 * reclaimer could load the old one, punch it, and have us write our
+	 * stale copy over the top of it. We hang on to our reference while
+	 * we save, so if someone picks us back up in the meantime, the last
+	 * one out does the cleanup */
+	blockmap_save(file);
+
+	g_static_mutex_lock(&parent->open_files_lock);
+	if (!g_atomic_int_dec_and_test(&file->refcnt)) {
+		g_static_mutex_unlock(&parent->open_files_lock);
+		return;
+	}
+
+	/* We might've been replaced by a newer version of the file */
+	if (g_hash_table_lookup(parent->open_files, file->key) == file)
+		g_hash_table_remove(parent->open_files, file->key);
+	g_static_mutex_unlock(&parent->open_files_lock);
+
+	block_cache_file_free(file);
+}
+
+int block_cache_read(struct BlockCacheFile* file, int source_fd, char* buf, size_t size, off_t offset)
+{
+	guint block_size = file->parent->block_size;
+	char* block_buf = NULL;
+	size_t done = 0;
+	ssize_t tmp = 0;
+
+	if (offset >= file->file_size)
+		return 0;
+	size = MIN(size, file->file_size - offset);
+
+	while (done < size) {
+		off_t cur = offset + done;
+		guint64 index = cur / block_size;
+		size_t block_offset = cur % block_size;
+		size_t chunk = MIN(block_size - block_offset, size - done);
+
+		g_static_rw_lock_reader_lock(&file->data_lock);
+		gboolean present = (block_claim(file, index, TRUE, TRUE) == BLOCK_PRESENT);
+		if (present)
+			tmp = pread(file->data_fd, buf + done, chunk, cur);
+		g_static_rw_lock_reader_unlock(&file->data_lock);
+
+		if (!present) {
+			/* Grab the whole block from the source, and serve the read
+			 * out of what we just fetched */
+			gboolean saved;
+			if (!block_buf)
+				block_buf = g_malloc(block_size);
+
+			tmp = block_cache_fetch(file, source_fd, index, block_buf, &saved);
+			block_release(file, index, saved);
+			if (tmp >= 0) {
+				tmp = (tmp > block_offset ? MIN(chunk, tmp - block_offset) : 0);
+				memcpy(buf + done, block_buf + block_offset, tmp);
+			}
+		}
+
+		if (tmp < 0 && errno == EINTR)
+			continue;
+		if (tmp <= 0)
+			break;
+		done += tmp;
+	}
+
+	g_free(block_buf);
+	return (done > 0 || tmp >= 0 ? done : -1);
+}
+
+int block_cache_prefetch(struct BlockCacheFile* file, int source_fd, off_t offset, size_t size)
+{
+	/* Pull in whatever blocks in this range we don't have yet, skipping
+	 * anything someone else is already fetching */
+	guint block_size = file->parent->block_size;
+	char* block_buf = NULL;
+	guint64 index;
+	int ret = 0;
+
+	if (offset >= file->file_size || size == 0)
+		return 0;
+	size = MIN(size, file->file_size - offset);
+
+	for(index = offset / block_size; index <= (offset + size - 1) / block_size; index++) {
+		gboolean saved;
+		ssize_t tmp;
+
+		if (block_claim(file, index, FALSE, FALSE) != BLOCK_CLAIMED)
+			continue;
+
+		if (!block_buf)
+			block_buf = g_malloc(block_size);
+
+		tmp = block_cache_fetch(file, source_fd, index, block_buf, &saved);
+		block_release(file, index, saved);
+		if (tmp < 0) {
+			ret = -1;
+			break;
+		}
+		ret++;
+	}
+
+	g_free(block_buf);
+	return ret;
+}
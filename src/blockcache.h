@@ -0,0 +1,41 @@
+/*
+ * blockcache.h - Userspace video caching filesystem
+ *
+ * Copyright 2008 Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef _BLOCKCACHE_H
+#define _BLOCKCACHE_H
+
+#include "stdafx.h"
+
+struct BlockCache;
+struct BlockCacheFile;
+
+struct BlockCache* block_cache_new(const char* cache_root, guint block_size);
+void block_cache_free(struct BlockCache* this);
+struct BlockCacheFile* block_cache_open(struct BlockCache* this, const char* relative_path, const struct stat* source_st);
+void block_cache_close(struct BlockCacheFile* file);
+int block_cache_read(struct BlockCacheFile* file, int source_fd, char* buf, size_t size, off_t offset);
+void block_cache_start_reclaimer(struct BlockCache* this, guint64 high_watermark, guint64 low_watermark);
+guint64 block_cache_reclaim_space(struct BlockCache* this, guint64 high_watermark, guint64 low_watermark);
+int block_cache_prefetch(struct BlockCacheFile* file, int source_fd, off_t offset, size_t size);
+
+#endif
@@ -0,0 +1,525 @@
+/*
+ * cacheindex.c - On-disk index of cached files
+ *
+ * Copyright 2008 Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include "stdafx.h"
+#include "cacheindex.h"
+#include <sys/mman.h>
+
+/* Walking and stat'ing the whole cache at mount time gets slow once there
+ * are a lot of files in it, so we keep a list of what's in the cache next
+ * to it instead. '<cache>.index' is a snapshot of every file, and every
+ * change after that gets appended to '<cache>.journal'. At mount time we
+ * map the snapshot, replay the journal over it, and we're done; every so
+ * often, the cache manager writes out a fresh snapshot and we start the
+ * journal over.
+ *
+ * Everything is stored little-endian, and both the snapshot and each
+ * journal record carry a CRC. A snapshot that doesn't check out means the
+ * caller has to go rescan the cache; a journal record that doesn't check
+ * out is assumed to be a write we crashed in the middle of, and it and
+ * everything after it are dropped.
+ *
+ * Logging a change only queues the record up in memory, since callers do
+ * it with their own locks held; cache_index_flush() writes the queue out
+ * afterwards, and with sync set, makes sure it's on disk. Whatever hasn't
+ * been synced when we crash is gone, so the cache manager has to cope with
+ * finding files the index doesn't know about */
+
+#define CACHEINDEX_MAGIC 	0x58494356 	/* 'VCIX' */
+#define CACHEINDEX_VERSION 	1
+
+#define JOURNAL_MIN_RECORDS 	4096
+
+enum { RECORD_ADD = 1, RECORD_REMOVE, RECORD_TOUCH };
+
+/* NOTE: No padding in here, it's written as-is */
+struct CacheIndexHeader {
+	guint32 magic;
+	guint32 version;
+	guint64 count;
+	guint64 body_len;
+	guint32 body_crc;
+	guint32 header_crc;
+};
+
+/* Each record is [op:1][size:8][mtime:8][path_len:2][path], and journal
+ * records have a [crc:4] in front */
+#define RECORD_FIXED_LEN 	(1 + 8 + 8 + 2)
+
+struct IndexRecord {
+	guint8 op;
+	guint64 size;
+	gint64 mtime;
+	guint16 path_len;
+	const char* path;
+};
+
+struct CacheIndex {
+	char* index_path;
+	char* journal_path;
+
+	int journal_fd;
+	guint journal_records;
+
+	/* Records that haven't been written to the journal yet; protected
+	 * by lock, while flush_lock keeps writers to the journal in order */
+	GByteArray* pending;
+	GStaticMutex lock;
+	GStaticMutex flush_lock;
+};
+
+struct CacheIndexWriter {
+	GByteArray* body;
+	struct CacheIndexHeader h;
+
+	/* Journal records the snapshot already covers, which weren't written
+	 * out yet when we took it */
+	GByteArray* cut;
+	guint cut_records;
+};
+
+
+/*
+ * CRC-32 (the zlib one)
+ */
+
+static guint32 crc_table[256];
+static GOnce crc_table_once = G_ONCE_INIT;
+
+static gpointer build_crc_table(gpointer dontcare)
+{
+	guint32 i, j;
+	for(i=0; i < 256; i++) {
+		guint32 c = i;
+		for(j=0; j < 8; j++)
+			c = (c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1);
+		crc_table[i] = c;
+	}
+	return NULL;
+}
+
+static guint32 crc32_update(guint32 crc, const void* buf, gsize len)
+{
+	const guint8* p = buf;
+	g_once(&crc_table_once, build_crc_table, NULL);
+
+	crc = ~crc;
+	while (len--)
+		crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+
+/*
+ * Records
+ */
+
+static gsize encode_record(guint8* buf, guint8 op, const char* path, guint64 size, gint64 mtime)
+{
+	guint16 path_len = MIN(strlen(path), G_MAXUINT16);
+	guint64 le64;
+	guint16 le16;
+
+	buf[0] = op;
+	le64 = GUINT64_TO_LE(size); 		memcpy(buf + 1, &le64, 8);
+	le64 = GUINT64_TO_LE((guint64)mtime); 	memcpy(buf + 9, &le64, 8);
+	le16 = GUINT16_TO_LE(path_len); 	memcpy(buf + 17, &le16, 2);
+	memcpy(buf + RECORD_FIXED_LEN, path, path_len);
+
+	return RECORD_FIXED_LEN + path_len;
+}
+
+static gsize decode_record(const guint8* buf, gsize avail, struct IndexRecord* out)
+{
+	/* Returns how much we used, or 0 if there isn't a whole record here */
+	guint64 le64;
+	guint16 le16;
+
+	if (avail < RECORD_FIXED_LEN)
+		return 0;
+
+	out->op = buf[0];
+	memcpy(&le64, buf + 1, 8); 	out->size = GUINT64_FROM_LE(le64);
+	memcpy(&le64, buf + 9, 8); 	out->mtime = (gint64)GUINT64_FROM_LE(le64);
+	memcpy(&le16, buf + 17, 2); 	out->path_len = GUINT16_FROM_LE(le16);
+	out->path = (const char*)buf + RECORD_FIXED_LEN;
+
+	if (avail < RECORD_FIXED_LEN + out->path_len)
+		return 0;
+	return RECORD_FIXED_LEN + out->path_len;
+}
+
+static const guint8* map_file(const char* path, gsize* len)
+{
+	struct stat st;
+	void* ret;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		close(fd);
+		return NULL;
+	}
+
+	ret = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (ret == MAP_FAILED)
+		return NULL;
+
+	*len = st.st_size;
+	return ret;
+}
+
+
+/*
+ * Public functions
+ */
+
+struct CacheIndex* cache_index_open(const char* cache_root)
+{
+	struct CacheIndex* ret = g_new0(struct CacheIndex, 1);
+
+	/* The index lives next to the cache, which may not exist yet */
+	char* parent = g_path_get_dirname(cache_root);
+	g_mkdir_with_parents(parent, 5+7*8+7*8*8);
+	g_free(parent);
+
+	ret->index_path = g_strdup_printf("%s.index", cache_root);
+	ret->journal_path = g_strdup_printf("%s.journal", cache_root);
+	ret->journal_fd = open(ret->journal_path, O_WRONLY | O_APPEND | O_CREAT, S_IRUSR | S_IWUSR);
+	ret->pending = g_byte_array_new();
+	g_static_mutex_init(&ret->lock);
+	g_static_mutex_init(&ret->flush_lock);
+	return ret;
+}
+
+void cache_index_close(struct CacheIndex* this)
+{
+	if (!this)
+		return;
+
+	cache_index_flush(this, TRUE);
+	if (this->journal_fd >= 0)
+		close(this->journal_fd);
+	g_byte_array_free(this->pending, TRUE);
+	g_static_mutex_free(&this->lock);
+	g_static_mutex_free(&this->flush_lock);
+	g_free(this->index_path);
+	g_free(this->journal_path);
+	g_free(this);
+}
+
+static char* record_path(const struct IndexRecord* record)
+{
+	return g_strndup(record->path, record->path_len);
+}
+
+static gboolean load_snapshot(struct CacheIndex* this, CacheIndexAddFunc add, gpointer context)
+{
+	struct CacheIndexHeader h;
+	gboolean ret = FALSE;
+	gsize len = 0, pos;
+	guint64 i;
+
+	const guint8* map = map_file(this->index_path, &len);
+	if (!map)
+		return FALSE;
+
+	if (len < sizeof(h))
+		goto out;
+
+	memcpy(&h, map, sizeof(h));
+	if (GUINT32_FROM_LE(h.magic) != CACHEINDEX_MAGIC || GUINT32_FROM_LE(h.version) != CACHEINDEX_VERSION)
+		goto out;
+	if (crc32_update(0, &h, G_STRUCT_OFFSET(struct CacheIndexHeader, header_crc)) != GUINT32_FROM_LE(h.header_crc))
+		goto out;
+	if (GUINT64_FROM_LE(h.body_len) != len - sizeof(h) ||
+	    crc32_update(0, map + sizeof(h), len - sizeof(h)) != GUINT32_FROM_LE(h.body_crc))
+		goto out;
+
+	/* It checks out, so everything in here is good */
+	pos = sizeof(h);
+	for(i=0; i < GUINT64_FROM_LE(h.count); i++) {
+		struct IndexRecord record;
+		gsize used = decode_record(map + pos, len - pos, &record);
+		if (!used)
+			goto out;
+
+		char* path = record_path(&record);
+		add(path, record.size, (time_t)record.mtime, context);
+		g_free(path);
+		pos += used;
+	}
+
+	ret = TRUE;
+
+out:
+	munmap((void*)map, len);
+	return ret;
+}
+
+static void replay_journal(struct CacheIndex* this, CacheIndexAddFunc add, CacheIndexRemoveFunc remove, 
+		CacheIndexTouchFunc touch, gpointer context)
+{
+	gsize len = 0, pos = 0;
+	const guint8* map = map_file(this->journal_path, &len);
+	if (!map)
+		return;
+
+	while (pos + 4 < len) {
+		struct IndexRecord record;
+		guint32 crc;
+		gsize used;
+
+		memcpy(&crc, map + pos, 4);
+		if ( !(used = decode_record(map + pos + 4, len - pos - 4, &record)) ||
+		     crc32_update(0, map + pos + 4, used) != GUINT32_FROM_LE(crc) )
+			break;
+
+		char* path = record_path(&record);
+		switch (record.op) {
+		case RECORD_ADD:
+			add(path, record.size, (time_t)record.mtime, context);
+			break;
+		case RECORD_REMOVE:
+			remove(path, context);
+			break;
+		case RECORD_TOUCH:
+			touch(path, (time_t)record.mtime, context);
+			break;
+		}
+		g_free(path);
+
+		pos += 4 + used;
+		this->journal_records++;
+	}
+
+	munmap((void*)map, len);
+
+	/* Chop off whatever we were in the middle of writing when we died,
+	 * so new records don't end up behind it */
+	if (pos < len && this->journal_fd >= 0) {
+		g_warning("Dropping %lu bytes of damaged cache journal", (unsigned long)(len - pos));
+		if (ftruncate(this->journal_fd, pos) < 0)
+			g_warning("Couldn't truncate cache journal: %s", strerror(errno));
+	}
+}
+
+gboolean cache_index_load(struct CacheIndex* this, CacheIndexAddFunc add, CacheIndexRemoveFunc remove, 
+		CacheIndexTouchFunc touch, gpointer context)
+{
+	/* NOTE: If this fails, whatever add() was given so far is garbage */
+	if (!this || !load_snapshot(this, add, context))
+		return FALSE;
+
+	replay_journal(this, add, remove, touch, context);
+	return TRUE;
+}
+
+static void append_record(struct CacheIndex* this, guint8 op, const char* path, guint64 size, time_t mtime)
+{
+	guint8* buf;
+	gsize len;
+	guint32 crc;
+
+	if (!this || this->journal_fd < 0)
+		return;
+
+	buf = g_malloc(4 + RECORD_FIXED_LEN + strlen(path));
+	len = encode_record(buf + 4, op, path, size, mtime);
+	crc = GUINT32_TO_LE(crc32_update(0, buf + 4, len));
+	memcpy(buf, &crc, 4);
+
+	g_static_mutex_lock(&this->lock);
+	g_byte_array_append(this->pending, buf, len + 4);
+	this->journal_records++;
+	g_static_mutex_unlock(&this->lock);
+
+	g_free(buf);
+}
+
+void cache_index_flush(struct CacheIndex* this, gboolean sync)
+{
+	/* Without sync, we're on someone's open path; if somebody else is
+	 * already writing, they (or the next flush) will get our records */
+	GByteArray* to_write;
+
+	if (!this || this->journal_fd < 0)
+		return;
+
+	if (sync)
+		g_static_mutex_lock(&this->flush_lock);
+	else if (!g_static_mutex_trylock(&this->flush_lock))
+		return;
+
+	g_static_mutex_lock(&this->lock);
+	to_write = this->pending;
+	this->pending = g_byte_array_new();
+	g_static_mutex_unlock(&this->lock);
+
+	/* NOTE: O_APPEND makes each write land in one piece */
+	if (to_write->len > 0 && write(this->journal_fd, to_write->data, to_write->len) != (ssize_t)to_write->len)
+		g_warning("Couldn't write cache journal: %s", strerror(errno));
+	if (sync)
+		fsync(this->journal_fd);
+
+	g_static_mutex_unlock(&this->flush_lock);
+	g_byte_array_free(to_write, TRUE);
+}
+
+void cache_index_log_add(struct CacheIndex* this, const char* relative_path, guint64 size, time_t mtime)
+{
+	append_record(this, RECORD_ADD, relative_path, size, mtime);
+}
+
+void cache_index_log_remove(struct CacheIndex* this, const char* relative_path)
+{
+	append_record(this, RECORD_REMOVE, relative_path, 0, 0);
+}
+
+void cache_index_log_touch(struct CacheIndex* this, const char* relative_path, time_t mtime)
+{
+	append_record(this, RECORD_TOUCH, relative_path, 0, mtime);
+}
+
+gboolean cache_index_needs_compaction(struct CacheIndex* this, guint item_count)
+{
+	/* Once the journal's bigger than a fresh snapshot would be, it's
+	 * worth starting over */
+	return (this && this->journal_records >= MAX(JOURNAL_MIN_RECORDS, item_count));
+}
+
+struct CacheIndexWriter* cache_index_rewrite_begin(struct CacheIndex* this)
+{
+	/* NOTE: The snapshot gets built up in memory, so the caller only has
+	 * to hold their lock while they add to it, and not while we write it
+	 * out. We keep the journal to ourselves until finish, so whatever's in
+	 * there now is stuff the snapshot will cover */
+	struct CacheIndexWriter* ret;
+	if (!this)
+		return NULL;
+
+	g_static_mutex_lock(&this->flush_lock);
+
+	ret = g_new0(struct CacheIndexWriter, 1);
+	ret->body = g_byte_array_new();
+	return ret;
+}
+
+void cache_index_rewrite_add(struct CacheIndexWriter* writer, const char* relative_path, guint64 size, time_t mtime)
+{
+	guint8* buf;
+	gsize len;
+
+	if (!writer)
+		return;
+
+	buf = g_malloc(RECORD_FIXED_LEN + strlen(relative_path));
+	len = encode_record(buf, RECORD_ADD, relative_path, size, mtime);
+	g_byte_array_append(writer->body, buf, len);
+
+	writer->h.count++;
+	writer->h.body_len += len;
+	writer->h.body_crc = crc32_update(writer->h.body_crc, buf, len);
+	g_free(buf);
+}
+
+void cache_index_rewrite_cut(struct CacheIndex* this, struct CacheIndexWriter* writer)
+{
+	/* NOTE: Call this under the same lock as the adds; anything logged
+	 * before now is in the snapshot, anything logged after isn't */
+	if (!writer)
+		return;
+
+	g_static_mutex_lock(&this->lock);
+	writer->cut = this->pending;
+	writer->cut_records = this->journal_records;
+	this->pending = g_byte_array_new();
+	this->journal_records = 0;
+	g_static_mutex_unlock(&this->lock);
+}
+
+static int write_snapshot(const char* tmp_path, struct CacheIndexWriter* writer)
+{
+	int fd, ret = 0;
+	struct CacheIndexHeader h;
+
+	h.magic = GUINT32_TO_LE(CACHEINDEX_MAGIC);
+	h.version = GUINT32_TO_LE(CACHEINDEX_VERSION);
+	h.count = GUINT64_TO_LE(writer->h.count);
+	h.body_len = GUINT64_TO_LE(writer->h.body_len);
+	h.body_crc = GUINT32_TO_LE(writer->h.body_crc);
+	h.header_crc = GUINT32_TO_LE(crc32_update(0, &h, G_STRUCT_OFFSET(struct CacheIndexHeader, header_crc)));
+
+	if ( (fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) < 0)
+		return -errno;
+
+	errno = 0;
+	if (write(fd, &h, sizeof(h)) != sizeof(h) ||
+	    write(fd, writer->body->data, writer->body->len) != (ssize_t)writer->body->len ||
+	    fsync(fd) != 0) {
+		ret = -(errno ? errno : EIO);
+	}
+
+	close(fd);
+	return ret;
+}
+
+int cache_index_rewrite_finish(struct CacheIndex* this, struct CacheIndexWriter* writer)
+{
+	int ret;
+	if (!writer)
+		return -EINVAL;
+
+	char* tmp_path = g_strdup_printf("%s.tmp", this->index_path);
+	ret = write_snapshot(tmp_path, writer);
+	if (ret == 0 && rename(tmp_path, this->index_path) < 0)
+		ret = -errno;
+
+	if (ret == 0) {
+		/* The snapshot has everything the journal did */
+		if (this->journal_fd >= 0)
+			ftruncate(this->journal_fd, 0);
+	} else {
+		/* The old snapshot's still good, so the journal has to keep
+		 * everything that goes with it */
+		unlink(tmp_path);
+		if (writer->cut && writer->cut->len > 0 && this->journal_fd >= 0 &&
+		    write(this->journal_fd, writer->cut->data, writer->cut->len) == (ssize_t)writer->cut->len) {
+			g_static_mutex_lock(&this->lock);
+			this->journal_records += writer->cut_records;
+			g_static_mutex_unlock(&this->lock);
+		}
+	}
+
+	g_static_mutex_unlock(&this->flush_lock);
+
+	if (writer->cut)
+		g_byte_array_free(writer->cut, TRUE);
+	g_byte_array_free(writer->body, TRUE);
+	g_free(writer);
+	g_free(tmp_path);
+	return ret;
+}
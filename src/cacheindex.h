@@ -0,0 +1,51 @@
+/*
+ * cacheindex.h - Userspace video caching filesystem
+ *
+ * Copyright 2008 Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef _CACHEINDEX_H
+#define _CACHEINDEX_H
+
+#include "stdafx.h"
+
+typedef void (*CacheIndexAddFunc) (const char* relative_path, guint64 size, time_t mtime, gpointer context);
+typedef void (*CacheIndexRemoveFunc) (const char* relative_path, gpointer context);
+typedef void (*CacheIndexTouchFunc) (const char* relative_path, time_t mtime, gpointer context);
+
+struct CacheIndex;
+struct CacheIndexWriter;
+
+struct CacheIndex* cache_index_open(const char* cache_root);
+void cache_index_close(struct CacheIndex* this);
+gboolean cache_index_load(struct CacheIndex* this, CacheIndexAddFunc add, CacheIndexRemoveFunc remove, 
+		CacheIndexTouchFunc touch, gpointer context);
+void cache_index_log_add(struct CacheIndex* this, const char* relative_path, guint64 size, time_t mtime);
+void cache_index_log_remove(struct CacheIndex* this, const char* relative_path);
+void cache_index_log_touch(struct CacheIndex* this, const char* relative_path, time_t mtime);
+void cache_index_flush(struct CacheIndex* this, gboolean sync);
+gboolean cache_index_needs_compaction(struct CacheIndex* this, guint item_count);
+
+struct CacheIndexWriter* cache_index_rewrite_begin(struct CacheIndex* this);
+void cache_index_rewrite_add(struct CacheIndexWriter* writer, const char* relative_path, guint64 size, time_t mtime);
+void cache_index_rewrite_cut(struct CacheIndex* this, struct CacheIndexWriter* writer);
+int cache_index_rewrite_finish(struct CacheIndex* this, struct CacheIndexWriter* writer);
+
+#endif
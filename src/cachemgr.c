@@ -24,89 +24,85 @@
 #include "stdafx.h"
 #include "stats.h"
 #include "cachemgr.h"
+#include "cachepolicy.h"
+#include "sketch.h"
+#include "cacheindex.h"
 
-#define CACHEITEM_TAG 'tIaC'
+/* Cached files are kept in a hash by path, and the eviction policy keeps
+ * its own bookkeeping inside each item, so that touching, adding, and
+ * dropping a file never has to go looking for it. The total size is kept
+ * up to date as items come and go. Every change also goes into the cache
+ * index, so the next mount doesn't have to go walk the whole cache to
+ * find out what's in it */
+
+struct CacheItem;
 
 struct CacheManager {
 	char* cache_root;
 
-	CMCanDeleteCallback can_delete_callback;
+	CMFilterDeletableCallback filter_callback;
 	gpointer user_context;
 
-	GSList* cached_file_list;
+	/* If set, evicted files get handed here instead of being deleted */
+	CMDemoteCallback demote_callback;
+	gpointer demote_context;
+
+	GHashTable* items;
+	struct CachePolicy* policy;
+	guint64 total_size;
+
+	/* How often files get opened, so we can turn away files that won't
+	 * be worth what they'd push out */
+	struct FreqSketch* sketch;
+
+	/* NOTE: Only written to with the writer lock held */
+	struct CacheIndex* index;
 	GStaticRWLock cached_file_list_rwlock;
-};
 
-/* FIXME: This code is porta-tarded */
-struct CacheItemHeader {
-	unsigned long tag;
-	size_t struct_size;
-	time_t mtime;
-	guint64 filesize;
+	/* Background eviction, between the watermarks */
+	GThread* evictor;
+	GMutex* evictor_lock;
+	GCond* evictor_cond;
+	gboolean evictor_quit;
+	guint64 high_watermark;
+	guint64 low_watermark;
 };
 
+/* How many eviction candidates we look at at a time, and how often (in
+ * seconds) the evictor checks up on things if nobody pokes it */
+#define EVICT_BATCH_SIZE 	512
+#define EVICTOR_INTERVAL 	5
+
 struct CacheItem {
-	struct CacheItemHeader h;
+	time_t mtime;
+	guint64 filesize;
 	char* path;
-};
 
-static struct CacheItem* cacheitem_new(const char* full_path)
-{
-	/* We will only return a new item if this is a valid path, and not 
-	 * something other than a file */
-	struct stat st;
-	if(lstat(full_path, &st) != 0 || !S_ISREG(st.st_mode))
-		return NULL;
+	struct CachePolicyEntry pe;
+};
 
-	struct CacheItem* ret = g_new0(struct CacheItem, 1);
-	ret->path = g_strdup(full_path);
-	ret->h.tag = CACHEITEM_TAG;
-	ret->h.mtime = st.st_mtime;
-	ret->h.filesize = st.st_size;
-	ret->h.struct_size = sizeof(struct CacheItemHeader) + ((strlen(full_path) + 1) * sizeof(char));
-	return ret;
-}
+#define ITEM_FROM_ENTRY(entry) 	((struct CacheItem*)((char*)(entry) - G_STRUCT_OFFSET(struct CacheItem, pe)))
 
-static struct CacheItem* cacheitem_load(int fd)
+static struct CacheItem* cacheitem_new_from_index(const char* full_path, guint64 filesize, time_t mtime)
 {
-	char* buf = NULL;
 	struct CacheItem* ret = g_new0(struct CacheItem, 1);
-
-	if(read(fd, ret, sizeof(struct CacheItemHeader)) != sizeof(struct CacheItemHeader))
-		goto failed;
-
-	if(ret->h.tag != CACHEITEM_TAG)
-		goto failed;
-
-	if(ret->h.struct_size <= sizeof(struct CacheItemHeader))
-		goto failed;
-
-	size_t to_read = ret->h.struct_size - sizeof(struct CacheItemHeader);
-	buf = g_new0(char, to_read);
-	if(read(fd, buf, to_read) != to_read)
-		goto failed;
-
-	ret->path = buf;
+	ret->path = g_strdup(full_path);
+	ret->mtime = mtime;
+	ret->filesize = filesize;
 	return ret;
-
-failed:
-	if(buf != NULL)
-		g_free(buf);
-	if(ret != NULL)
-		g_free(ret);
-	return NULL;
 }
 
-static int cacheitem_save(int fd, struct CacheItem* obj)
+static struct CacheItem* cacheitem_new(const char* full_path)
 {
-	if(write(fd, &obj->h, sizeof(struct CacheItemHeader)) != sizeof(struct CacheItemHeader))
-		return -errno;
-
-	size_t to_write = obj->h.struct_size - sizeof(struct CacheItemHeader);
-	if(write(fd, obj->path, to_write) != to_write)
-		return -errno;
+	/* We will only return a new item if this is a valid path, and not 
+	 * something other than a file */
+	struct stat st;
+	if(lstat(full_path, &st) != 0 || !S_ISREG(st.st_mode))
+		return NULL;
 
-	return 0;
+	/* NOTE: A cached file's mtime is the source's, so we go by when it
+	 * last changed here instead */
+	return cacheitem_new_from_index(full_path, st.st_size, st.st_ctime);
 }
 
 static void cacheitem_free(struct CacheItem* obj)
@@ -132,10 +128,60 @@ static void cacheitem_free_list(GSList* to_free)
 	g_slist_free(to_free);
 }
 
+/* NOTE: These all expect the writer lock to be held */
+
+static void add_item(struct CacheManager* this, struct CacheItem* item)
+{
+	/* If we already knew about this file, the new one wins */
+	struct CacheItem* old = g_hash_table_lookup(this->items, item->path);
+	if (old) {
+		cache_policy_removed(this->policy, &old->pe, FALSE);
+		g_hash_table_remove(this->items, old->path);
+		this->total_size -= old->filesize;
+		cacheitem_free(old);
+	}
+
+	item->pe.key = item->path;
+	item->pe.size = item->filesize;
+	g_hash_table_insert(this->items, item->path, item);
+	cache_policy_added(this->policy, &item->pe);
+	this->total_size += item->filesize;
+}
+
+static void remove_item(struct CacheManager* this, struct CacheItem* item, gboolean evicted)
+{
+	cache_policy_removed(this->policy, &item->pe, evicted);
+	g_hash_table_remove(this->items, item->path);
+	this->total_size -= item->filesize;
+}
+
+static gboolean clear_item(gpointer key, gpointer val, gpointer cache_manager)
+{
+	struct CacheManager* this = cache_manager;
+	struct CacheItem* item = val;
+
+	cache_policy_removed(this->policy, &item->pe, FALSE);
+	cacheitem_free(item);
+	return TRUE;
+}
+
+static void clear_items(struct CacheManager* this)
+{
+	g_hash_table_foreach_remove(this->items, clear_item, this);
+	this->total_size = 0;
+}
+
+static const char* relative_path_for(struct CacheManager* this, const char* full_path)
+{
+	/* The index keeps paths relative to the cache root */
+	size_t len = strlen(this->cache_root);
+	return (strncmp(full_path, this->cache_root, len) ? full_path : full_path + len);
+}
+
 #if FALSE
 static void cacheitem_touch(struct CacheItem* this)
 {
-	this->h.mtime = time(NULL);
+	this->mtime = time(NULL);
 
 	/* Attempt to touch the file itself */
 	int fd;
@@ -158,24 +204,38 @@ out:
 
 static gint cache_item_sortfunc(gconstpointer lhs, gconstpointer rhs)
 {
-	time_t lhs_t = ((struct CacheItem*)lhs)->h.mtime;
-	time_t rhs_t = ((struct CacheItem*)rhs)->h.mtime;
+	/* Oldest first, so adding them in order leaves the newest at the head */
+	time_t lhs_t = ((struct CacheItem*)lhs)->mtime;
+	time_t rhs_t = ((struct CacheItem*)rhs)->mtime;
 
 	if (lhs_t == rhs_t)
 		return 0;
-	return (lhs_t < rhs_t ? 1 : -1);
+	return (lhs_t < rhs_t ? -1 : 1);
+}
+
+static void add_items_from_list(struct CacheManager* this, GSList* list)
+{
+	GSList* iter;
+	list = g_slist_sort(list, cache_item_sortfunc);
+	for(iter = list; iter; iter = g_slist_next(iter))
+		add_item(this, iter->data);
+	g_slist_free(list);
 }
 
 static void rebuild_cacheitem_list_from_root_helper(GSList** list, const char* root_path, GDir* root)
 {
 	const gchar* entry = NULL;
 	while ( (entry = g_dir_read_name(root)) ) {
+		/* Fills that haven't finished aren't in the cache yet */
+		if (g_str_has_suffix(entry, ".partial"))
+			continue;
+
 		gchar* full_path = g_build_filename(root_path, entry, NULL);
 
-		/* If this is a file in the cache, add it, sorted by mtime */
+		/* If this is a file in the cache, add it; we sort them later */
 		struct CacheItem* item = cacheitem_new(full_path);
 		if (item) {
-			*list = g_slist_insert_sorted(*list, item, cache_item_sortfunc);
+			*list = g_slist_prepend(*list, item);
 			goto done;
 		}
 
@@ -202,24 +262,176 @@ static void rebuild_cacheitem_list_from_root(struct CacheManager* this, const ch
 
 	/* Switch out the list and trash the old one */
 	g_static_rw_lock_writer_lock(&this->cached_file_list_rwlock);
-	GSList* to_free = this->cached_file_list;
-	this->cached_file_list = ret;
+	clear_items(this);
+	add_items_from_list(this, ret);
 	g_static_rw_lock_writer_unlock(&this->cached_file_list_rwlock);
+}
+
+static void index_add_item(const char* relative_path, guint64 size, time_t mtime, gpointer cache_manager)
+{
+	struct CacheManager* this = cache_manager;
+	char* full_path = g_build_filename(this->cache_root, relative_path, NULL);
+	add_item(this, cacheitem_new_from_index(full_path, size, mtime));
+	g_free(full_path);
+}
+
+static void index_remove_item(const char* relative_path, gpointer cache_manager)
+{
+	struct CacheManager* this = cache_manager;
+	char* full_path = g_build_filename(this->cache_root, relative_path, NULL);
+	struct CacheItem* item = g_hash_table_lookup(this->items, full_path);
+	if (item) {
+		remove_item(this, item, FALSE);
+		cacheitem_free(item);
+	}
+	g_free(full_path);
+}
 
-	cacheitem_free_list(to_free);
+static void index_touch_item(const char* relative_path, time_t mtime, gpointer cache_manager)
+{
+	struct CacheManager* this = cache_manager;
+	char* full_path = g_build_filename(this->cache_root, relative_path, NULL);
+	struct CacheItem* item = g_hash_table_lookup(this->items, full_path);
+	if (item) {
+		item->mtime = mtime;
+		cache_policy_touched(this->policy, &item->pe);
+	}
+	g_free(full_path);
+}
+
+/* Stupid struct to pass a tuple through to this fn */
+struct rewrite_context {
+	struct CacheManager* this;
+	struct CacheIndexWriter* writer;
+};
+
+static gboolean rewrite_index_item(struct CachePolicyEntry* entry, gpointer rewrite_context)
+{
+	/* NOTE: We write these out best-victim first, so loading them back in
+	 * order gets the policy back to about where it was */
+	struct rewrite_context* ctx = rewrite_context;
+	struct CacheItem* item = ITEM_FROM_ENTRY(entry);
+	cache_index_rewrite_add(ctx->writer, relative_path_for(ctx->this, item->path), item->filesize, item->mtime);
+	return FALSE;
 }
 
-struct CacheManager* cache_manager_new(const char* cache_root, CMCanDeleteCallback callback, gpointer context)
+static int rewrite_index(struct CacheManager* this)
+{
+	/* NOTE: The reader lock keeps anyone from logging while we take the
+	 * snapshot; writing it out happens after we've let go */
+	struct rewrite_context ctx = { this, cache_index_rewrite_begin(this->index) };
+	if (!ctx.writer)
+		return -EIO;
+
+	g_static_rw_lock_reader_lock(&this->cached_file_list_rwlock);
+	cache_policy_foreach_victim(this->policy, rewrite_index_item, &ctx);
+	cache_index_rewrite_cut(this->index, ctx.writer);
+	g_static_rw_lock_reader_unlock(&this->cached_file_list_rwlock);
+
+	return cache_index_rewrite_finish(this->index, ctx.writer);
+}
+
+static gpointer evictor_thread(gpointer cache_manager)
+{
+	struct CacheManager* this = cache_manager;
+	GTimeVal wake_at;
+
+	g_mutex_lock(this->evictor_lock);
+	while (!this->evictor_quit) {
+		g_get_current_time(&wake_at);
+		g_time_val_add(&wake_at, EVICTOR_INTERVAL * G_USEC_PER_SEC);
+		g_cond_timed_wait(this->evictor_cond, this->evictor_lock, &wake_at);
+		if (this->evictor_quit)
+			break;
+		g_mutex_unlock(this->evictor_lock);
+
+		/* Once we go over the high mark, make enough room that we don't
+		 * have to come right back */
+		if (cache_manager_get_size(this) > this->high_watermark)
+			cache_manager_reclaim_space(this, this->low_watermark);
+		cache_manager_compact_index(this);
+
+		/* Make sure what we've logged so far survives a crash */
+		cache_index_flush(this->index, TRUE);
+
+		g_mutex_lock(this->evictor_lock);
+	}
+	g_mutex_unlock(this->evictor_lock);
+
+	return NULL;
+}
+
+void cache_manager_set_demote_callback(struct CacheManager* this, CMDemoteCallback callback, gpointer context)
+{
+	/* NOTE: Set this before starting the evictor */
+	this->demote_callback = callback;
+	this->demote_context = context;
+}
+
+void cache_manager_start_evictor(struct CacheManager* this, guint64 high_watermark, guint64 low_watermark)
+{
+	if (!this || this->evictor)
+		return;
+
+	this->high_watermark = high_watermark;
+	this->low_watermark = MIN(low_watermark, high_watermark);
+	this->evictor_lock = g_mutex_new();
+	this->evictor_cond = g_cond_new();
+	this->evictor = g_thread_create(evictor_thread, this, TRUE, NULL);
+}
+
+static void stop_evictor(struct CacheManager* this)
+{
+	if (!this->evictor)
+		return;
+
+	g_mutex_lock(this->evictor_lock);
+	this->evictor_quit = TRUE;
+	g_cond_signal(this->evictor_cond);
+	g_mutex_unlock(this->evictor_lock);
+
+	g_thread_join(this->evictor);
+	g_mutex_free(this->evictor_lock);
+	g_cond_free(this->evictor_cond);
+	this->evictor = NULL;
+}
+
+static void kick_evictor(struct CacheManager* this)
+{
+	if (!this->evictor)
+		return;
+
+	g_mutex_lock(this->evictor_lock);
+	g_cond_signal(this->evictor_cond);
+	g_mutex_unlock(this->evictor_lock);
+}
+
+struct CacheManager* cache_manager_new(const char* cache_root, const char* policy, guint admission_width, 
+		CMFilterDeletableCallback callback, gpointer context)
 {
 	struct CacheManager* ret = g_new0(struct CacheManager, 1);
 	if (!ret)
 		goto failed;
 	ret->cache_root = g_strdup(cache_root);
-	ret->can_delete_callback = callback;  ret->user_context = context;
+	ret->filter_callback = callback;  ret->user_context = context;
 
+	ret->items = g_hash_table_new(g_str_hash, g_str_equal);
+	ret->policy = cache_policy_new(policy);
+	g_message("Cache '%s' is using the %s eviction policy", cache_root, cache_policy_get_name(ret->policy));
+	if (admission_width > 0)
+		ret->sketch = freq_sketch_new(admission_width);
 	g_static_rw_lock_init(&ret->cached_file_list_rwlock);
 
-	rebuild_cacheitem_list_from_root(ret, cache_root);
+	/* Load up what we knew at the end of last time; if we can't trust
+	 * that, go look at what's actually there and start a new index */
+	ret->index = cache_index_open(cache_root);
+	if (!cache_index_load(ret->index, index_add_item, index_remove_item, index_touch_item, ret)) {
+		g_message("Rescanning cache '%s'", cache_root);
+		clear_items(ret);
+		rebuild_cacheitem_list_from_root(ret, cache_root);
+
+		rewrite_index(ret);
+	}
 
 	return ret;
 
@@ -237,7 +449,16 @@ void cache_manager_free(struct CacheManager* obj)
 	if (!obj)
 		return;
 
-	cacheitem_free_list(obj->cached_file_list);
+	stop_evictor(obj);
+
+	/* Save a fresh snapshot, so next time there's no journal to replay */
+	rewrite_index(obj);
+	cache_index_close(obj->index);
+
+	clear_items(obj);
+	g_hash_table_destroy(obj->items);
+	cache_policy_free(obj->policy);
+	freq_sketch_free(obj->sketch);
 	g_free(obj->cache_root);
 	g_free(obj);
 }
@@ -247,134 +468,213 @@ guint64 cache_manager_get_size(struct CacheManager* this)
 	if (!this)
 		return 0;
 
-	/* Run through the list and sum the sizes */
-	guint64 ret = 0;
+	guint64 ret;
 	g_static_rw_lock_reader_lock(&this->cached_file_list_rwlock);
-	GSList* iter = this->cached_file_list;
-	while (iter) {
-		ret += ((struct CacheItem*)iter->data)->h.filesize;
-		iter = g_slist_next(iter);
-	}
+	ret = this->total_size;
 	g_static_rw_lock_reader_unlock(&this->cached_file_list_rwlock);
 
 	return ret;
 }
 
 
-int cache_manager_loadstate(struct CacheManager* this, const char* path)
+void cache_manager_compact_index(struct CacheManager* this)
 {
-	int fd;
-	if ((fd = open(path, O_RDONLY)) < 0)
-		return -errno;
+	gboolean needed;
 
-	g_static_rw_lock_writer_lock(&this->cached_file_list_rwlock);
+	g_static_rw_lock_reader_lock(&this->cached_file_list_rwlock);
+	needed = cache_index_needs_compaction(this->index, g_hash_table_size(this->items));
+	g_static_rw_lock_reader_unlock(&this->cached_file_list_rwlock);
 
-	struct CacheItem* item;
-	cacheitem_free_list(this->cached_file_list);
-	while( (item = cacheitem_load(fd)) ) {
-		this->cached_file_list = g_slist_insert_sorted(this->cached_file_list, item, cache_item_sortfunc);
-	}
+	if (needed)
+		rewrite_index(this);
+}
+
+void cache_manager_notify_added(struct CacheManager* this, const char* full_path)
+{
+	struct CacheItem* item = NULL;
+	if (! (item = cacheitem_new(full_path)) )
+		return;
 
+	g_static_rw_lock_writer_lock(&this->cached_file_list_rwlock);
+	add_item(this, item);
+	cache_index_log_add(this->index, relative_path_for(this, item->path), item->filesize, item->mtime);
+	gboolean over = (this->total_size > this->high_watermark);
 	g_static_rw_lock_writer_unlock(&this->cached_file_list_rwlock);
-	close(fd);
-	return 0;
+	cache_index_flush(this->index, FALSE);
+
+	if (over)
+		kick_evictor(this);
 }
 
-int cache_manager_savestate(struct CacheManager* this, const char* path)
+void cache_manager_notify_opened(struct CacheManager* this, const char* full_path)
 {
-	int ret = 0;
-	int fd;
-	if ((fd = open(path, O_WRONLY)) < 0)
-		return -errno;
+	freq_sketch_increment(this->sketch, full_path);
+}
 
-	g_static_rw_lock_reader_lock(&this->cached_file_list_rwlock);
+static gboolean find_first_victim(struct CachePolicyEntry* entry, gpointer victim)
+{
+	*((struct CachePolicyEntry**)victim) = entry;
+	return TRUE;
+}
 
-	GSList* iter = this->cached_file_list;
-	while (iter) {
-		struct CacheItem* item = iter->data;
+gboolean cache_manager_should_admit(struct CacheManager* this, const char* full_path, guint64 size, guint64 max_size)
+{
+	/* Without a sketch, or if there's room, everyone gets in */
+	if (!this->sketch)
+		return TRUE;
 
-		if ((ret = cacheitem_save(fd, item)))
-			goto out;
+	struct CachePolicyEntry* victim = NULL;
+	guint victim_freq = 0;
+	gboolean has_room;
 
-		iter = g_slist_next(iter);
+	g_static_rw_lock_reader_lock(&this->cached_file_list_rwlock);
+	has_room = (this->total_size + size <= max_size);
+	if (!has_room) {
+		cache_policy_foreach_victim(this->policy, find_first_victim, &victim);
+		if (victim)
+			victim_freq = freq_sketch_estimate(this->sketch, victim->key);
 	}
-
-out:
 	g_static_rw_lock_reader_unlock(&this->cached_file_list_rwlock);
 
-	close(fd);
-	return ret;
+	if (has_room || !victim)
+		return TRUE;
+
+	/* Only take the file if it's been wanted more than what it'd replace */
+	return (freq_sketch_estimate(this->sketch, full_path) > victim_freq);
 }
 
-void cache_manager_notify_added(struct CacheManager* this, const char* full_path)
+/* Stupid struct to pass a tuple through to this fn */
+struct reclaim_context {
+	guint skip;
+	guint64 wanted;
+	guint64 collected;
+	GPtrArray* paths;
+};
+
+static gboolean reclaim_visit_item(struct CachePolicyEntry* entry, gpointer reclaim_context)
 {
-	struct CacheItem* item = NULL;
-	if (! (item = cacheitem_new(full_path)) )
-		return;
+	struct reclaim_context* ctx = reclaim_context;
 
-	g_static_rw_lock_writer_lock(&this->cached_file_list_rwlock);
-	this->cached_file_list = g_slist_insert_sorted(this->cached_file_list, item, cache_item_sortfunc);
-	g_static_rw_lock_writer_unlock(&this->cached_file_list_rwlock);
+	/* Skip over the ones we already know we can't have */
+	if (ctx->skip > 0) {
+		ctx->skip--;
+		return FALSE;
+	}
+
+	g_ptr_array_add(ctx->paths, g_strdup(entry->key));
+	ctx->collected += entry->size;
+	return (ctx->collected >= ctx->wanted || ctx->paths->len >= EVICT_BATCH_SIZE);
 }
 
 guint64 cache_manager_reclaim_space(struct CacheManager* this, guint64 max_size)
 {
-	guint64 current_size = cache_manager_get_size(this);
-	if (current_size <= max_size)
-		return 0;
-
 	GSList* remove_list = NULL;
+	GSList* iter;
 	guint64 removed_size = 0;
-	guint64 remove_at_least = current_size;
+	guint skip = 0;
+	guint i;
+
+	while (TRUE) {
+		struct reclaim_context ctx = { skip, 0, 0, g_ptr_array_new() };
+
+		/* Grab a batch of candidates from the policy, best first; we
+		 * take a few more than we need, in case some are open */
+		g_static_rw_lock_reader_lock(&this->cached_file_list_rwlock);
+		if (this->total_size > max_size) {
+			ctx.wanted = (this->total_size - max_size) * 2;
+			cache_policy_foreach_victim(this->policy, reclaim_visit_item, &ctx);
+		}
+		g_static_rw_lock_reader_unlock(&this->cached_file_list_rwlock);
 
-	/* Iterate through the sorted list, looking for files we can delete */
-	g_static_rw_lock_reader_lock(&this->cached_file_list_rwlock);
-	GSList* iter = this->cached_file_list;
-	while (iter && removed_size < remove_at_least) {
-		struct CacheItem* item = iter->data;
+		if (ctx.paths->len == 0) {
+			g_ptr_array_free(ctx.paths, TRUE);
+			break;
+		}
 
-		if ( item && (this->can_delete_callback)(item->path, this->user_context) ) {
+		/* Find out which ones are in use, all in one go and without our
+		 * lock held */
+		gboolean* deletable = g_new0(gboolean, ctx.paths->len);
+		(this->filter_callback)((const char**)ctx.paths->pdata, deletable, ctx.paths->len, this->user_context);
+
+		/* Now pull them out, unless they went away while we weren't looking */
+		g_static_rw_lock_writer_lock(&this->cached_file_list_rwlock);
+		for(i=0; i < ctx.paths->len && this->total_size > max_size; i++) {
+			struct CacheItem* item;
+			if (!deletable[i]) {
+				skip++;
+				continue;
+			}
+			if ( !(item = g_hash_table_lookup(this->items, g_ptr_array_index(ctx.paths, i))) )
+				continue;
+
+			remove_item(this, item, TRUE);
+			cache_index_log_remove(this->index, relative_path_for(this, item->path));
 			remove_list = g_slist_prepend(remove_list, item);
-			unlink(item->path);
-			removed_size += item->h.filesize;
+			removed_size += item->filesize;
 		}
-
-		iter = g_slist_next(iter);
+		gboolean done = (this->total_size <= max_size);
+		g_static_rw_lock_writer_unlock(&this->cached_file_list_rwlock);
+		cache_index_flush(this->index, FALSE);
+
+		for(i=0; i < ctx.paths->len; i++)
+			g_free(g_ptr_array_index(ctx.paths, i));
+		g_ptr_array_free(ctx.paths, TRUE);
+		g_free(deletable);
+
+		/* NOTE: Every batch either removes or skips each of its candidates,
+		 * so we run out of candidates eventually even if they're all open */
+		if (done)
+			break;
 	}
-	g_static_rw_lock_reader_unlock(&this->cached_file_list_rwlock);
 
-	/* Remove the list of deleted items from the cache manager and free
-	 * the delete list */
-	g_static_rw_lock_writer_lock(&this->cached_file_list_rwlock);
-	iter = remove_list;
-	while (iter) {
-		this->cached_file_list = g_slist_remove(this->cached_file_list, iter->data);
-		iter = g_slist_next(iter);
+	/* Nobody can see these anymore, so we can take our time deleting (or
+	 * demoting) them */
+	for(iter = remove_list; iter; iter = g_slist_next(iter)) {
+		struct CacheItem* item = iter->data;
+		if (!this->demote_callback || !(this->demote_callback)(item->path, this->demote_context))
+			unlink(item->path);
 	}
-	g_static_rw_lock_writer_unlock(&this->cached_file_list_rwlock);
-
 	cacheitem_free_list(remove_list);
 
 	return removed_size;
 }
 
-void cache_manager_touch_file(struct CacheManager* this, const char* full_path)
+void cache_manager_notify_removed(struct CacheManager* this, const char* full_path)
 {
+	/* Someone knows this copy is no good anymore; forget it and get rid
+	 * of it, whether or not we were tracking it */
+	struct CacheItem* item;
 	g_static_rw_lock_writer_lock(&this->cached_file_list_rwlock);
+	if ( (item = g_hash_table_lookup(this->items, full_path)) ) {
+		remove_item(this, item, FALSE);
+		cache_index_log_remove(this->index, relative_path_for(this, item->path));
+	}
+	g_static_rw_lock_writer_unlock(&this->cached_file_list_rwlock);
+	cache_index_flush(this->index, FALSE);
 
-	GSList* iter = this->cached_file_list;
-	struct CacheItem* item = iter->data;
-	while (iter) {
-		item = iter->data;
-		if (!strcmp(item->path, full_path))
-			break;
+	unlink(full_path);
+	cacheitem_free(item);
+}
 
-		iter = g_slist_next(iter);
-	}
+void cache_manager_touch_file(struct CacheManager* this, const char* full_path)
+{
+	struct CacheItem* item;
+	g_static_rw_lock_writer_lock(&this->cached_file_list_rwlock);
 
-	if (iter != NULL) {
-		this->cached_file_list = g_slist_remove_link(this->cached_file_list, iter);
+	if ( (item = g_hash_table_lookup(this->items, full_path)) ) {
+		item->mtime = time(NULL);
+		cache_policy_touched(this->policy, &item->pe);
+		cache_index_log_touch(this->index, relative_path_for(this, item->path), item->mtime);
 	}
 
 	g_static_rw_lock_writer_unlock(&this->cached_file_list_rwlock);
+
+	/* A file we don't know about is one the index lost in a crash (or
+	 * one that was never logged); start tracking it again, so it counts
+	 * against the size limit and can be evicted */
+	if (!item) {
+		cache_manager_notify_added(this, full_path);
+		return;
+	}
+	cache_index_flush(this->index, FALSE);
 }
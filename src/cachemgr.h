@@ -27,18 +27,23 @@
 #include "stdafx.h"
 #include "queue.h"
 
-typedef gboolean (*CMCanDeleteCallback) (const char* path, gpointer context);
+typedef void (*CMFilterDeletableCallback) (const char** paths, gboolean* deletable, guint count, gpointer context);
 typedef void (*CMShouldCacheCallback) (const char* path, gpointer context);
+typedef gboolean (*CMDemoteCallback) (const char* full_path, gpointer context);
 
 struct CacheManager;
 
-struct CacheManager* cache_manager_new(const char* cache_root, CMCanDeleteCallback callback, gpointer context);
+struct CacheManager* cache_manager_new(const char* cache_root, const char* policy, guint admission_width, 
+		CMFilterDeletableCallback callback, gpointer context);
 void cache_manager_free(struct CacheManager* obj);
-int cache_manager_loadstate(struct CacheManager* obj, const char* path);
-int cache_manager_savestate(struct CacheManager* obj, const char* path);
 guint64 cache_manager_get_size(struct CacheManager* this);
 void cache_manager_notify_added(struct CacheManager* this, const char* full_path);
+void cache_manager_notify_removed(struct CacheManager* this, const char* full_path);
 void cache_manager_notify_opened(struct CacheManager* this, const char* full_path);
+gboolean cache_manager_should_admit(struct CacheManager* this, const char* full_path, guint64 size, guint64 max_size);
+void cache_manager_compact_index(struct CacheManager* this);
+void cache_manager_set_demote_callback(struct CacheManager* this, CMDemoteCallback callback, gpointer context);
+void cache_manager_start_evictor(struct CacheManager* this, guint64 high_watermark, guint64 low_watermark);
 guint64 cache_manager_reclaim_space(struct CacheManager* this, guint64 max_size);
 void cache_manager_touch_file(struct CacheManager* this, const char* full_path);
 
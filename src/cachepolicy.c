@@ -0,0 +1,436 @@
+/*
+ * cachepolicy.c - Eviction policies for the cache manager
+ *
+ * Copyright 2008 Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include "stdafx.h"
+#include "cachepolicy.h"
+
+/* An eviction policy decides which cached files go first when we need
+ * room. It gets told when files come, go, and get used, and hands back
+ * its candidates best-victim-first; the cache manager decides which of
+ * those it can actually delete. None of these lock anything, the cache
+ * manager holds its own lock around every call.
+ *
+ * lru  - Least recently used goes first
+ * 2q   - New files sit in a probationary FIFO, and only get into the main
+ *        LRU if they come back after falling out of it, so one pass over
+ *        the library can't flush the files people actually play
+ * gdsf - GreedyDual-Size-Frequency; small files that get used a lot
+ *        are worth more than one huge file that was played once */
+
+struct CachePolicyOps {
+	const char* name;
+	gpointer (*new)(void);
+	void (*free)(gpointer state);
+	void (*added)(gpointer state, struct CachePolicyEntry* entry);
+	void (*touched)(gpointer state, struct CachePolicyEntry* entry);
+	void (*removed)(gpointer state, struct CachePolicyEntry* entry, gboolean evicted);
+	void (*foreach_victim)(gpointer state, CachePolicyVisitFunc func, gpointer context);
+};
+
+struct CachePolicy {
+	const struct CachePolicyOps* ops;
+	gpointer state;
+};
+
+
+/*
+ * Lists
+ */
+
+struct PolicyList {
+	struct CachePolicyEntry* head;
+	struct CachePolicyEntry* tail;
+	guint64 bytes;
+	guint count;
+};
+
+static void list_unlink(struct PolicyList* list, struct CachePolicyEntry* entry)
+{
+	if (entry->prev)
+		entry->prev->next = entry->next;
+	else
+		list->head = entry->next;
+
+	if (entry->next)
+		entry->next->prev = entry->prev;
+	else
+		list->tail = entry->prev;
+
+	entry->prev = entry->next = NULL;
+	list->bytes -= entry->size;
+	list->count--;
+}
+
+static void list_push_head(struct PolicyList* list, struct CachePolicyEntry* entry)
+{
+	entry->prev = NULL;
+	entry->next = list->head;
+	if (list->head)
+		list->head->prev = entry;
+	else
+		list->tail = entry;
+	list->head = entry;
+
+	list->bytes += entry->size;
+	list->count++;
+}
+
+static gboolean list_visit_from_tail(struct PolicyList* list, CachePolicyVisitFunc func, gpointer context)
+{
+	/* NOTE: The visitor mustn't change the list out from under us */
+	struct CachePolicyEntry* iter;
+	for(iter = list->tail; iter; iter = iter->prev) {
+		if (func(iter, context))
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+
+/*
+ * LRU
+ */
+
+static gpointer lru_new(void)
+{
+	return g_new0(struct PolicyList, 1);
+}
+
+static void lru_added(gpointer state, struct CachePolicyEntry* entry)
+{
+	list_push_head(state, entry);
+}
+
+static void lru_touched(gpointer state, struct CachePolicyEntry* entry)
+{
+	list_unlink(state, entry);
+	list_push_head(state, entry);
+}
+
+static void lru_removed(gpointer state, struct CachePolicyEntry* entry, gboolean evicted)
+{
+	list_unlink(state, entry);
+}
+
+static void lru_foreach_victim(gpointer state, CachePolicyVisitFunc func, gpointer context)
+{
+	list_visit_from_tail(state, func, context);
+}
+
+static const struct CachePolicyOps lru_ops = {
+	.name 		= "lru",
+	.new 		= lru_new,
+	.free 		= g_free,
+	.added 		= lru_added,
+	.touched 	= lru_touched,
+	.removed 	= lru_removed,
+	.foreach_victim = lru_foreach_victim,
+};
+
+
+/*
+ * 2Q
+ */
+
+/* How much of the cache new files may take up before they're the first
+ * to go, and how many evicted names we remember (relative to the number
+ * of resident files) */
+#define TWOQ_IN_PERCENT 	25
+#define TWOQ_GHOST_MIN 		256
+
+enum { TWOQ_IN = 0, TWOQ_MAIN };
+
+struct TwoQState {
+	struct PolicyList in;
+	struct PolicyList main;
+
+	/* Names of files that fell out of 'in', oldest at the tail */
+	GHashTable* ghosts;
+	GQueue* ghost_order;
+};
+
+static gpointer twoq_new(void)
+{
+	struct TwoQState* ret = g_new0(struct TwoQState, 1);
+	ret->ghosts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	ret->ghost_order = g_queue_new();
+	return ret;
+}
+
+static void twoq_free(gpointer state)
+{
+	struct TwoQState* this = state;
+
+	/* NOTE: The hash owns the strings in ghost_order */
+	g_queue_free(this->ghost_order);
+	g_hash_table_destroy(this->ghosts);
+	g_free(this);
+}
+
+static void twoq_trim_ghosts(struct TwoQState* this)
+{
+	guint max_ghosts = MAX(TWOQ_GHOST_MIN, (this->in.count + this->main.count) / 2);
+	while (g_queue_get_length(this->ghost_order) > max_ghosts) {
+		char* oldest = g_queue_pop_tail(this->ghost_order);
+		g_hash_table_remove(this->ghosts, oldest);
+	}
+}
+
+static void twoq_added(gpointer state, struct CachePolicyEntry* entry)
+{
+	struct TwoQState* this = state;
+
+	/* We've seen this one before, it goes right into the main list */
+	if (g_hash_table_lookup(this->ghosts, entry->key)) {
+		entry->queue = TWOQ_MAIN;
+		list_push_head(&this->main, entry);
+		return;
+	}
+
+	entry->queue = TWOQ_IN;
+	list_push_head(&this->in, entry);
+}
+
+static void twoq_touched(gpointer state, struct CachePolicyEntry* entry)
+{
+	/* NOTE: Hits in 'in' don't count; that's what keeps a file that was
+	 * opened twice in a row by a scanner from looking popular */
+	struct TwoQState* this = state;
+	if (entry->queue == TWOQ_MAIN) {
+		list_unlink(&this->main, entry);
+		list_push_head(&this->main, entry);
+	}
+}
+
+static void twoq_removed(gpointer state, struct CachePolicyEntry* entry, gboolean evicted)
+{
+	struct TwoQState* this = state;
+	if (entry->queue == TWOQ_MAIN) {
+		list_unlink(&this->main, entry);
+		return;
+	}
+
+	list_unlink(&this->in, entry);
+
+	/* Remember it, so if it comes back we know it's worth keeping */
+	if (evicted && !g_hash_table_lookup(this->ghosts, entry->key)) {
+		char* key = g_strdup(entry->key);
+		g_hash_table_insert(this->ghosts, key, GUINT_TO_POINTER(1));
+		g_queue_push_head(this->ghost_order, key);
+		twoq_trim_ghosts(this);
+	}
+}
+
+static void twoq_foreach_victim(gpointer state, CachePolicyVisitFunc func, gpointer context)
+{
+	struct TwoQState* this = state;
+	guint64 total = this->in.bytes + this->main.bytes;
+
+	/* New files go first once they've taken more than their share */
+	if (this->in.bytes * 100 > total * TWOQ_IN_PERCENT) {
+		if (!list_visit_from_tail(&this->in, func, context))
+			list_visit_from_tail(&this->main, func, context);
+	} else {
+		if (!list_visit_from_tail(&this->main, func, context))
+			list_visit_from_tail(&this->in, func, context);
+	}
+}
+
+static const struct CachePolicyOps twoq_ops = {
+	.name 		= "2q",
+	.new 		= twoq_new,
+	.free 		= twoq_free,
+	.added 		= twoq_added,
+	.touched 	= twoq_touched,
+	.removed 	= twoq_removed,
+	.foreach_victim = twoq_foreach_victim,
+};
+
+
+/*
+ * GDSF
+ */
+
+struct GdsfState {
+	/* Entries sorted by priority, lowest first */
+	GTree* by_priority;
+
+	/* The priority of the last thing we threw out; everything new starts
+	 * from here, which ages out files that were popular a long time ago */
+	gdouble inflation;
+	guint64 next_seq;
+};
+
+static gint gdsf_compare(gconstpointer lhs, gconstpointer rhs)
+{
+	const struct CachePolicyEntry* l = lhs;
+	const struct CachePolicyEntry* r = rhs;
+
+	if (l->priority != r->priority)
+		return (l->priority < r->priority ? -1 : 1);
+	if (l->seq != r->seq)
+		return (l->seq < r->seq ? -1 : 1);
+	return 0;
+}
+
+static void gdsf_update_priority(struct GdsfState* this, struct CachePolicyEntry* entry)
+{
+	/* H = L + frequency / size, with size counted in 64k chunks so an
+	 * empty file doesn't blow up */
+	gdouble chunks = 1.0 + (gdouble)entry->size / (64 * 1024);
+	entry->priority = this->inflation + (gdouble)entry->frequency / chunks;
+	entry->seq = this->next_seq++;
+}
+
+static gpointer gdsf_new(void)
+{
+	struct GdsfState* ret = g_new0(struct GdsfState, 1);
+	ret->by_priority = g_tree_new(gdsf_compare);
+	return ret;
+}
+
+static void gdsf_free(gpointer state)
+{
+	struct GdsfState* this = state;
+	g_tree_destroy(this->by_priority);
+	g_free(this);
+}
+
+static void gdsf_added(gpointer state, struct CachePolicyEntry* entry)
+{
+	struct GdsfState* this = state;
+	entry->frequency = 1;
+	gdsf_update_priority(this, entry);
+	g_tree_insert(this->by_priority, entry, entry);
+}
+
+static void gdsf_touched(gpointer state, struct CachePolicyEntry* entry)
+{
+	struct GdsfState* this = state;
+	g_tree_remove(this->by_priority, entry);
+	entry->frequency++;
+	gdsf_update_priority(this, entry);
+	g_tree_insert(this->by_priority, entry, entry);
+}
+
+static void gdsf_removed(gpointer state, struct CachePolicyEntry* entry, gboolean evicted)
+{
+	struct GdsfState* this = state;
+	g_tree_remove(this->by_priority, entry);
+	if (evicted && entry->priority > this->inflation)
+		this->inflation = entry->priority;
+}
+
+/* Stupid struct to pass a tuple through to this fn */
+struct gdsf_visit {
+	CachePolicyVisitFunc func;
+	gpointer context;
+};
+
+static gboolean gdsf_visit_item(gpointer key, gpointer val, gpointer gdsf_visit)
+{
+	struct gdsf_visit* visit = gdsf_visit;
+	return visit->func(val, visit->context);
+}
+
+static void gdsf_foreach_victim(gpointer state, CachePolicyVisitFunc func, gpointer context)
+{
+	struct GdsfState* this = state;
+	struct gdsf_visit visit = { func, context };
+	g_tree_foreach(this->by_priority, gdsf_visit_item, &visit);
+}
+
+static const struct CachePolicyOps gdsf_ops = {
+	.name 		= "gdsf",
+	.new 		= gdsf_new,
+	.free 		= gdsf_free,
+	.added 		= gdsf_added,
+	.touched 	= gdsf_touched,
+	.removed 	= gdsf_removed,
+	.foreach_victim = gdsf_foreach_victim,
+};
+
+
+/*
+ * Public functions
+ */
+
+static const struct CachePolicyOps* all_policies[] = { &lru_ops, &twoq_ops, &gdsf_ops, NULL };
+
+struct CachePolicy* cache_policy_new(const char* name)
+{
+	const struct CachePolicyOps* ops = &lru_ops;
+	int i;
+
+	if (name && *name) {
+		for(i=0; all_policies[i]; i++) {
+			if (!g_ascii_strcasecmp(all_policies[i]->name, name))
+				break;
+		}
+
+		if (all_policies[i])
+			ops = all_policies[i];
+		else
+			g_warning("Unknown eviction policy '%s', using '%s'", name, ops->name);
+	}
+
+	struct CachePolicy* ret = g_new0(struct CachePolicy, 1);
+	ret->ops = ops;
+	ret->state = ops->new();
+	return ret;
+}
+
+void cache_policy_free(struct CachePolicy* this)
+{
+	if (!this)
+		return;
+
+	this->ops->free(this->state);
+	g_free(this);
+}
+
+const char* cache_policy_get_name(struct CachePolicy* this)
+{
+	return this->ops->name;
+}
+
+void cache_policy_added(struct CachePolicy* this, struct CachePolicyEntry* entry)
+{
+	this->ops->added(this->state, entry);
+}
+
+void cache_policy_touched(struct CachePolicy* this, struct CachePolicyEntry* entry)
+{
+	this->ops->touched(this->state, entry);
+}
+
+void cache_policy_removed(struct CachePolicy* this, struct CachePolicyEntry* entry, gboolean evicted)
+{
+	this->ops->removed(this->state, entry, evicted);
+}
+
+void cache_policy_foreach_victim(struct CachePolicy* this, CachePolicyVisitFunc func, gpointer context)
+{
+	this->ops->foreach_victim(this->state, func, context);
+}
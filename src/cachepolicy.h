@@ -0,0 +1,55 @@
+/*
+ * cachepolicy.h - Userspace video caching filesystem
+ *
+ * Copyright 2008 Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef _CACHEPOLICY_H
+#define _CACHEPOLICY_H
+
+#include "stdafx.h"
+
+/* The cache manager embeds one of these in every item it tracks; the
+ * owner fills in key and size, everything else belongs to the policy */
+struct CachePolicyEntry {
+	const char* key;
+	guint64 size;
+
+	struct CachePolicyEntry* prev;
+	struct CachePolicyEntry* next;
+	guint queue;
+	guint64 frequency;
+	gdouble priority;
+	guint64 seq;
+};
+
+typedef gboolean (*CachePolicyVisitFunc) (struct CachePolicyEntry* entry, gpointer context);
+
+struct CachePolicy;
+
+struct CachePolicy* cache_policy_new(const char* name);
+void cache_policy_free(struct CachePolicy* this);
+const char* cache_policy_get_name(struct CachePolicy* this);
+void cache_policy_added(struct CachePolicy* this, struct CachePolicyEntry* entry);
+void cache_policy_touched(struct CachePolicy* this, struct CachePolicyEntry* entry);
+void cache_policy_removed(struct CachePolicy* this, struct CachePolicyEntry* entry, gboolean evicted);
+void cache_policy_foreach_victim(struct CachePolicy* this, CachePolicyVisitFunc func, gpointer context);
+
+#endif
@@ -0,0 +1,189 @@
+/*
+ * copyqueue.c - Pool of cache copy workers
+ *
+ * Copyright 2008 Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include "stdafx.h"
+#include "copyqueue.h"
+
+/* Every file we want in the cache gets exactly one job, no matter how many
+ * times it's asked for - a job sits in the pending table from the time
+ * it's queued until a worker is completely done with it, and anyone who
+ * asks for the same file in the meantime just rides along. Several workers
+ * drain the queue, so one big movie doesn't hold up every song behind it */
+
+struct CopyJob {
+	char* relative_path;
+	gint waiters;
+};
+
+struct CopyQueue {
+	CopyQueueFunc func;
+	CopyQueueIdleFunc idle_func;
+	gpointer context;
+
+	GAsyncQueue* to_process;
+	GHashTable* pending;
+	GStaticMutex pending_lock;
+	GStaticMutex idle_lock;
+
+	GThread** threads;
+	guint thread_count;
+	gint should_quit;
+};
+
+/* Pushed once per worker on shutdown to wake everyone up */
+static struct CopyJob quit_sentinel;
+
+static void copy_job_free(struct CopyJob* job)
+{
+	if (!job || job == &quit_sentinel)
+		return;
+
+	g_free(job->relative_path);
+	g_free(job);
+}
+
+static gpointer copy_worker_thread(gpointer data)
+{
+	struct CopyQueue* this = data;
+
+	while(g_atomic_int_get(&this->should_quit) == 0) {
+		GTimeVal five_secs_from_now;
+		g_get_current_time(&five_secs_from_now);
+		g_time_val_add(&five_secs_from_now, 5 * 1000 * 1000);
+		struct CopyJob* job = g_async_queue_timed_pop(this->to_process, &five_secs_from_now);
+
+		/* We didn't have anything to do - let one of us do housekeeping */
+		if (!job) {
+			if (this->idle_func && g_static_mutex_trylock(&this->idle_lock)) {
+				(this->idle_func)(this->context);
+				g_static_mutex_unlock(&this->idle_lock);
+			}
+			continue;
+		}
+
+		if (job == &quit_sentinel)
+			continue;
+
+		g_debug("Starting copy, picked up '%s' (%d waiters)", job->relative_path, 
+			g_atomic_int_get(&job->waiters));
+		(this->func)(job->relative_path, this->context);
+
+		/* Only now can someone queue this file up again */
+		g_static_mutex_lock(&this->pending_lock);
+		g_hash_table_remove(this->pending, job->relative_path);
+		g_static_mutex_unlock(&this->pending_lock);
+		copy_job_free(job);
+	}
+
+	return NULL;
+}
+
+struct CopyQueue* copy_queue_new(guint workers, CopyQueueFunc func, CopyQueueIdleFunc idle_func, gpointer context)
+{
+	struct CopyQueue* ret = g_new0(struct CopyQueue, 1);
+	if (!ret || !func)
+		goto failed;
+
+	ret->func = func;
+	ret->idle_func = idle_func;
+	ret->context = context;
+
+	ret->to_process = g_async_queue_new();
+	ret->pending = g_hash_table_new(g_str_hash, g_str_equal);
+	g_static_mutex_init(&ret->pending_lock);
+	g_static_mutex_init(&ret->idle_lock);
+
+	ret->threads = g_new0(GThread*, MAX(workers, 1));
+	for(ret->thread_count=0; ret->thread_count < MAX(workers, 1); ret->thread_count++) {
+		if (!(ret->threads[ret->thread_count] = g_thread_create(copy_worker_thread, ret, TRUE, NULL)))
+			break;
+	}
+
+	if (ret->thread_count == 0)
+		goto failed;
+
+	return ret;
+
+failed:
+	if (ret) {
+		if (ret->to_process)
+			g_async_queue_unref(ret->to_process);
+		if (ret->pending)
+			g_hash_table_destroy(ret->pending);
+		g_free(ret->threads);
+		g_free(ret);
+	}
+	return NULL;
+}
+
+void copy_queue_free(struct CopyQueue* this)
+{
+	guint i;
+	if (!this)
+		return;
+
+	/* Signal the workers to terminate and wait for them
+	 * XXX: if a worker hangs, we're boned - no way to timeout this */
+	g_atomic_int_set(&this->should_quit, 1);
+	for(i=0; i < this->thread_count; i++)
+		g_async_queue_push(this->to_process, &quit_sentinel);
+	for(i=0; i < this->thread_count; i++)
+		g_thread_join(this->threads[i]);
+
+	/* Free whatever never got picked up */
+	struct CopyJob* item;
+	g_async_queue_lock(this->to_process);
+	while ( (item = g_async_queue_try_pop_unlocked(this->to_process)) )
+		copy_job_free(item);
+	g_async_queue_unlock(this->to_process);
+	g_async_queue_unref(this->to_process);
+
+	g_hash_table_destroy(this->pending);
+	g_free(this->threads);
+	g_free(this);
+}
+
+gboolean copy_queue_push(struct CopyQueue* this, const char* relative_path)
+{
+	struct CopyJob* job;
+	if (!this)
+		return FALSE;
+
+	g_static_mutex_lock(&this->pending_lock);
+
+	/* Someone's already on it - just join the existing job */
+	if ( (job = g_hash_table_lookup(this->pending, relative_path)) ) {
+		g_atomic_int_inc(&job->waiters);
+		g_static_mutex_unlock(&this->pending_lock);
+		return FALSE;
+	}
+
+	job = g_new0(struct CopyJob, 1);
+	job->relative_path = g_strdup(relative_path);
+	job->waiters = 1;
+	g_hash_table_insert(this->pending, job->relative_path, job);
+	g_static_mutex_unlock(&this->pending_lock);
+
+	g_async_queue_push(this->to_process, job);
+	return TRUE;
+}
@@ -0,0 +1,38 @@
+/*
+ * copyqueue.h - Userspace video caching filesystem
+ *
+ * Copyright 2008 Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef _COPYQUEUE_H
+#define _COPYQUEUE_H
+
+#include "stdafx.h"
+
+typedef void (*CopyQueueFunc) (const char* relative_path, gpointer context);
+typedef void (*CopyQueueIdleFunc) (gpointer context);
+
+struct CopyQueue;
+
+struct CopyQueue* copy_queue_new(guint workers, CopyQueueFunc func, CopyQueueIdleFunc idle_func, gpointer context);
+void copy_queue_free(struct CopyQueue* this);
+gboolean copy_queue_push(struct CopyQueue* this, const char* relative_path);
+
+#endif
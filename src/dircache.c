@@ -0,0 +1,231 @@
+/*
+ * dircache.c - Directory listing cache
+ *
+ * Copyright 2008 Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include "stdafx.h"
+#include "dircache.h"
+
+/* A snapshot is everything readdir() told us about a directory, plus the
+ * stat() of every entry, taken when the directory had a given mtime. As
+ * long as the directory's mtime (and ctime) hasn't changed, nothing has
+ * been added or removed, and we can hand the listing back without touching
+ * the source. Timestamps can be as coarse as a second, so a listing taken
+ * in the same second the directory last changed can't be trusted - it may
+ * have missed a change made a moment later that left the mtime alone.
+ * Snapshots are refcounted since a readdir may still be walking one when
+ * someone else replaces it */
+
+struct DirSnapshotEntry {
+	char* name;
+	gboolean has_stat;
+	struct stat st;
+};
+
+struct DirSnapshot {
+	gint refcnt;
+	time_t mtime;
+	long mtime_nsec;
+	time_t ctime;
+	long ctime_nsec;
+	gboolean racy;
+	guint64 last_used;
+	GPtrArray* entries;
+};
+
+struct DirCache {
+	guint max_dirs;
+	guint64 use_counter;
+
+	GHashTable* snapshots;
+	GStaticMutex lock;
+};
+
+static void dir_snapshot_free_entry(gpointer data, gpointer dontcare)
+{
+	struct DirSnapshotEntry* entry = data;
+	g_free(entry->name);
+	g_free(entry);
+}
+
+static void stat_times(const struct stat* st, long* mtime_nsec, long* ctime_nsec)
+{
+#ifdef HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+	*mtime_nsec = st->st_mtim.tv_nsec;
+	*ctime_nsec = st->st_ctim.tv_nsec;
+#else
+	*mtime_nsec = *ctime_nsec = 0;
+#endif
+}
+
+struct DirSnapshot* dir_snapshot_new(const struct stat* dir_st, time_t taken_at)
+{
+	/* NOTE: taken_at has to be from before we started reading the
+	 * directory */
+	struct DirSnapshot* ret = g_new0(struct DirSnapshot, 1);
+	ret->refcnt = 1;
+	ret->mtime = dir_st->st_mtime;
+	ret->ctime = dir_st->st_ctime;
+	stat_times(dir_st, &ret->mtime_nsec, &ret->ctime_nsec);
+	ret->racy = (ret->mtime >= taken_at || ret->ctime >= taken_at);
+	ret->entries = g_ptr_array_new();
+	return ret;
+}
+
+struct DirSnapshot* dir_snapshot_ref(struct DirSnapshot* snapshot)
+{
+	g_atomic_int_inc(&snapshot->refcnt);
+	return snapshot;
+}
+
+void dir_snapshot_unref(struct DirSnapshot* snapshot)
+{
+	if (!snapshot)
+		return;
+
+	if(g_atomic_int_dec_and_test(&snapshot->refcnt)) {
+		g_ptr_array_foreach(snapshot->entries, dir_snapshot_free_entry, NULL);
+		g_ptr_array_free(snapshot->entries, TRUE);
+		g_free(snapshot);
+	}
+}
+
+gboolean dir_snapshot_is_current(struct DirSnapshot* snapshot, const struct stat* dir_st)
+{
+	long mtime_nsec, ctime_nsec;
+	stat_times(dir_st, &mtime_nsec, &ctime_nsec);
+
+	return (!snapshot->racy && 
+		snapshot->mtime == dir_st->st_mtime && snapshot->mtime_nsec == mtime_nsec &&
+		snapshot->ctime == dir_st->st_ctime && snapshot->ctime_nsec == ctime_nsec);
+}
+
+void dir_snapshot_add(struct DirSnapshot* snapshot, const char* name, const struct stat* st)
+{
+	/* NOTE: Snapshots are only modified before they're inserted into the
+	 * cache, so there's no locking here */
+	struct DirSnapshotEntry* entry = g_new0(struct DirSnapshotEntry, 1);
+	entry->name = g_strdup(name);
+	if (st) {
+		entry->has_stat = TRUE;
+		entry->st = *st;
+	}
+	g_ptr_array_add(snapshot->entries, entry);
+}
+
+int dir_snapshot_foreach(struct DirSnapshot* snapshot, DirSnapshotFunc func, gpointer context)
+{
+	int ret = 0;
+	guint i;
+	for(i=0; i < snapshot->entries->len; i++) {
+		struct DirSnapshotEntry* entry = g_ptr_array_index(snapshot->entries, i);
+		if ((ret = func(entry->name, (entry->has_stat ? &entry->st : NULL), context)))
+			break;
+	}
+
+	return ret;
+}
+
+struct DirCache* dir_cache_new(guint max_dirs)
+{
+	struct DirCache* ret = g_new0(struct DirCache, 1);
+	if (!ret)
+		return NULL;
+
+	ret->max_dirs = max_dirs;
+	ret->snapshots = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)dir_snapshot_unref);
+	g_static_mutex_init(&ret->lock);
+	return ret;
+}
+
+void dir_cache_free(struct DirCache* this)
+{
+	if (!this)
+		return;
+
+	g_hash_table_destroy(this->snapshots);
+	g_static_mutex_free(&this->lock);
+	g_free(this);
+}
+
+struct DirSnapshot* dir_cache_lookup(struct DirCache* this, const char* path)
+{
+	struct DirSnapshot* ret;
+	if (!this)
+		return NULL;
+
+	g_static_mutex_lock(&this->lock);
+	if ( (ret = g_hash_table_lookup(this->snapshots, path)) ) {
+		ret->last_used = ++this->use_counter;
+		dir_snapshot_ref(ret);
+	}
+	g_static_mutex_unlock(&this->lock);
+
+	return ret;
+}
+
+/* Stupid struct to pass a tuple through to this fn */
+struct oldest_search {
+	const char* path;
+	guint64 last_used;
+};
+
+static void find_oldest_item(gpointer key, gpointer val, gpointer oldest_search)
+{
+	struct oldest_search* oldest = oldest_search;
+	struct DirSnapshot* snapshot = val;
+
+	if (!oldest->path || snapshot->last_used < oldest->last_used) {
+		oldest->path = key;
+		oldest->last_used = snapshot->last_used;
+	}
+}
+
+void dir_cache_insert(struct DirCache* this, const char* path, struct DirSnapshot* snapshot)
+{
+	if (!this || !this->max_dirs)
+		return;
+
+	g_static_mutex_lock(&this->lock);
+
+	/* Make room by dropping whoever was looked at longest ago */
+	if (!g_hash_table_lookup(this->snapshots, path) &&
+	    g_hash_table_size(this->snapshots) >= this->max_dirs) {
+		struct oldest_search oldest = { NULL, 0 };
+		g_hash_table_foreach(this->snapshots, find_oldest_item, &oldest);
+		if (oldest.path)
+			g_hash_table_remove(this->snapshots, oldest.path);
+	}
+
+	snapshot->last_used = ++this->use_counter;
+	g_hash_table_replace(this->snapshots, g_strdup(path), dir_snapshot_ref(snapshot));
+	g_static_mutex_unlock(&this->lock);
+}
+
+void dir_cache_invalidate(struct DirCache* this, const char* path)
+{
+	if (!this)
+		return;
+
+	g_static_mutex_lock(&this->lock);
+	g_hash_table_remove(this->snapshots, path);
+	g_static_mutex_unlock(&this->lock);
+}
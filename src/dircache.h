@@ -0,0 +1,47 @@
+/*
+ * dircache.h - Userspace video caching filesystem
+ *
+ * Copyright 2008 Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef _DIRCACHE_H
+#define _DIRCACHE_H
+
+#include "stdafx.h"
+
+typedef int (*DirSnapshotFunc) (const char* name, const struct stat* st, gpointer context);
+
+struct DirCache;
+struct DirSnapshot;
+
+struct DirCache* dir_cache_new(guint max_dirs);
+void dir_cache_free(struct DirCache* this);
+struct DirSnapshot* dir_cache_lookup(struct DirCache* this, const char* path);
+void dir_cache_insert(struct DirCache* this, const char* path, struct DirSnapshot* snapshot);
+void dir_cache_invalidate(struct DirCache* this, const char* path);
+
+struct DirSnapshot* dir_snapshot_new(const struct stat* dir_st, time_t taken_at);
+struct DirSnapshot* dir_snapshot_ref(struct DirSnapshot* snapshot);
+void dir_snapshot_unref(struct DirSnapshot* snapshot);
+gboolean dir_snapshot_is_current(struct DirSnapshot* snapshot, const struct stat* dir_st);
+void dir_snapshot_add(struct DirSnapshot* snapshot, const char* name, const struct stat* st);
+int dir_snapshot_foreach(struct DirSnapshot* snapshot, DirSnapshotFunc func, gpointer context);
+
+#endif
@@ -0,0 +1,651 @@
+/*
+ * fill.c - Moving bytes from the source into the cache
+ *
+ * Copyright 2008 Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include "stdafx.h"
+#include "fill.h"
+
+/* Copies a range of one file into the same range of another, in big
+ * chunks, letting the kernel move the data wherever it can. We try, in
+ * order:
+ *
+ * 	* copy_file_range(), which never brings the data into userspace
+ * 	* splice() through a pipe, which doesn't either
+ * 	* pread()/pwrite() through one big aligned buffer
+ *
+ * and fall back to the next one the first time a method says it can't
+ * handle this pair of files. Everything is positional, so several fills can
+ * write into different parts of the same file at once. sendfile() isn't
+ * on the list since it writes at the destination's file offset */
+
+/* While a fill is running, it keeps a list of the ranges that have landed
+ * in the destination (a FillProgress), so readers can be served out of
+ * the partial file instead of going back to the source */
+
+/* Big files get filled over several streams at once: whatever's missing
+ * is cut into FILL_RANGE_SIZE pieces, and a handful of threads, each with
+ * its own source fd, take turns grabbing the next one. On a high-latency
+ * link one stream can't keep the pipe full, but several can */
+
+/* A fill record is a small file saying which ranges of the staging file
+ * we know are on disk, and which version of the source they came from,
+ * so a fill that gets cut off can pick up where it was instead of
+ * starting over */
+
+#define FILL_CHUNK_SIZE 	(8 * 1024 * 1024)
+#define FILL_BUFFER_SIZE 	(1024 * 1024)
+#define FILL_PIPE_SIZE 		(1024 * 1024)
+#define FILL_RANGE_SIZE 	(32 * 1024 * 1024)
+
+#define FILLRECORD_MAGIC 	0x52464356 	/* 'VCFR' */
+#define FILLRECORD_VERSION 	2
+
+/* The relative path follows the header, and then extent_count start/end
+ * pairs; an mtime_nsec of zero means we didn't know it */
+struct FillRecordHeader {
+	guint32 magic;
+	guint32 version;
+	guint32 path_len;
+	guint32 mtime_nsec;
+	guint64 file_size;
+	gint64 	mtime;
+	guint64 extent_count;
+};
+
+struct FillRecordExtent {
+	guint64 start;
+	guint64 end;
+};
+
+struct FillExtent {
+	off_t start;
+	off_t end;
+};
+
+struct FillProgress {
+	gint refcnt;
+	gint dest_fd;
+
+	/* Sorted, non-overlapping, and protected by lock */
+	GArray* extents;
+	GStaticMutex lock;
+};
+
+struct FillJob {
+	const char* src_path;
+	int dest_fd;
+	gint* quitflag_atomic;
+	FillProgressFunc progress;
+	gpointer context;
+
+	/* Pieces left to copy, and how we're doing; protected by lock */
+	GArray* pieces;
+	guint next_piece;
+	int err;
+	GStaticMutex lock;
+};
+
+struct FillState {
+	int src_fd;
+	int dest_fd;
+
+	gboolean use_copy_file_range;
+	gboolean use_splice;
+	int pipe_fds[2];
+	size_t pipe_size;
+
+	char* buf;
+};
+
+static gboolean is_unsupported_errno(int err)
+{
+	return (err == ENOSYS || err == EXDEV || err == EINVAL || err == EOPNOTSUPP);
+}
+
+#ifdef HAVE_COPY_FILE_RANGE
+static ssize_t fill_chunk_copy_file_range(struct FillState* state, off_t offset, size_t len)
+{
+	loff_t in = offset, out = offset;
+	return copy_file_range(state->src_fd, &in, state->dest_fd, &out, len, 0);
+}
+#endif
+
+#ifdef HAVE_SPLICE
+static ssize_t fill_chunk_splice(struct FillState* state, off_t offset, size_t len)
+{
+	loff_t in = offset, out = offset;
+	ssize_t has_read, has_written = 0;
+
+	if (state->pipe_fds[0] < 0) {
+		if (pipe(state->pipe_fds) != 0) {
+			state->pipe_fds[0] = state->pipe_fds[1] = -1;
+			errno = ENOSYS;
+			return -1;
+		}
+#ifdef F_SETPIPE_SZ
+		fcntl(state->pipe_fds[1], F_SETPIPE_SZ, FILL_PIPE_SIZE);
+#endif
+	}
+
+	has_read = splice(state->src_fd, &in, state->pipe_fds[1], NULL, len, SPLICE_F_MOVE);
+	if (has_read <= 0)
+		return has_read;
+
+	/* Once it's in the pipe, it has to come out or the pipe is junk */
+	while (has_written < has_read) {
+		ssize_t tmp = splice(state->pipe_fds[0], NULL, state->dest_fd, &out, has_read - has_written, SPLICE_F_MOVE);
+		if (tmp < 0 && errno == EINTR)
+			continue;
+		if (tmp <= 0) {
+			state->use_splice = FALSE;
+			errno = EIO;
+			return -1;
+		}
+		has_written += tmp;
+	}
+
+	return has_written;
+}
+#endif
+
+static ssize_t fill_chunk_buffered(struct FillState* state, off_t offset, size_t len)
+{
+	ssize_t has_read, has_written = 0;
+
+	if (!state->buf) {
+#ifdef HAVE_POSIX_MEMALIGN
+		if (posix_memalign((void**)&state->buf, getpagesize(), FILL_BUFFER_SIZE) != 0)
+			return -1;
+#else
+		if (!(state->buf = malloc(FILL_BUFFER_SIZE)))
+			return -1;
+#endif
+	}
+
+	len = MIN(len, FILL_BUFFER_SIZE);
+	do {
+		has_read = pread(state->src_fd, state->buf, len, offset);
+	} while (has_read < 0 && errno == EINTR);
+
+	if (has_read <= 0)
+		return has_read;
+
+	while (has_written < has_read) {
+		ssize_t tmp = pwrite(state->dest_fd, state->buf + has_written, has_read - has_written, offset + has_written);
+		if (tmp < 0 && errno == EINTR)
+			continue;
+		if (tmp <= 0)
+			return -1;
+		has_written += tmp;
+	}
+
+	return has_written;
+}
+
+static ssize_t fill_chunk(struct FillState* state, off_t offset, size_t len)
+{
+	ssize_t ret;
+
+#ifdef HAVE_COPY_FILE_RANGE
+	if (state->use_copy_file_range) {
+		/* Some filesystems claim EOF when they just don't support it, so
+		 * double check a zero the slow way */
+		if ((ret = fill_chunk_copy_file_range(state, offset, len)) > 0)
+			return ret;
+		if (ret < 0 && !is_unsupported_errno(errno))
+			return ret;
+
+		state->use_copy_file_range = FALSE;
+	}
+#endif
+
+#ifdef HAVE_SPLICE
+	if (state->use_splice) {
+		if ((ret = fill_chunk_splice(state, offset, len)) > 0)
+			return ret;
+		if (ret < 0 && !is_unsupported_errno(errno) && state->use_splice)
+			return ret;
+
+		state->use_splice = FALSE;
+	}
+#endif
+
+	ret = fill_chunk_buffered(state, offset, len);
+	return ret;
+}
+
+off_t fill_copy_range(int src_fd, int dest_fd, off_t offset, off_t length, gint* quitflag_atomic, 
+		FillProgressFunc progress, gpointer context)
+{
+	/* NOTE: A negative length means copy until EOF */
+	struct FillState state;
+	off_t done = 0;
+	int err = 0;
+
+	memset(&state, 0, sizeof(state));
+	state.src_fd = src_fd;  state.dest_fd = dest_fd;
+	state.use_copy_file_range = TRUE;
+	state.use_splice = TRUE;
+	state.pipe_fds[0] = state.pipe_fds[1] = -1;
+
+#ifdef HAVE_POSIX_FADVISE
+	posix_fadvise(src_fd, offset, (length > 0 ? length : 0), POSIX_FADV_SEQUENTIAL);
+#endif
+
+	while (length < 0 || done < length) {
+		size_t len = (length < 0 ? FILL_CHUNK_SIZE : MIN(FILL_CHUNK_SIZE, length - done));
+		ssize_t tmp;
+
+		if (quitflag_atomic && g_atomic_int_get(quitflag_atomic)) {
+			err = EINTR;
+			break;
+		}
+
+		tmp = fill_chunk(&state, offset + done, len);
+		if (tmp < 0 && errno == EINTR)
+			continue;
+		if (tmp < 0) {
+			err = errno;
+			break;
+		}
+		if (tmp == 0)
+			break;
+
+#ifdef HAVE_POSIX_FADVISE
+		/* We won't be reading these again, so don't crowd out the page
+		 * cache with them */
+		posix_fadvise(src_fd, offset + done, tmp, POSIX_FADV_DONTNEED);
+#endif
+
+		/* NOTE: Progress gets told about each chunk as it lands */
+		done += tmp;
+		if (progress && !(progress)(offset + done - tmp, tmp, context)) {
+			err = EINTR;
+			break;
+		}
+	}
+
+	if (state.pipe_fds[0] >= 0) {
+		close(state.pipe_fds[0]);
+		close(state.pipe_fds[1]);
+	}
+	free(state.buf);
+
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	return done;
+}
+
+
+static gboolean fill_job_update(off_t offset, off_t length, gpointer fill_job)
+{
+	/* NOTE: Every stream reports through here, and none of them wait for
+	 * each other to do it, so progress has to cope with that */
+	struct FillJob* job = fill_job;
+	int err;
+
+	g_static_mutex_lock(&job->lock);
+	err = job->err;
+	g_static_mutex_unlock(&job->lock);
+
+	if (err || (job->progress && !(job->progress)(offset, length, job->context)))
+		return FALSE;
+	return TRUE;
+}
+
+static gpointer fill_job_thread(gpointer fill_job)
+{
+	struct FillJob* job = fill_job;
+	int src_fd = open(job->src_path, O_RDONLY);
+	int err = (src_fd < 0 ? errno : 0);
+
+	while (!err) {
+		struct FillExtent piece;
+
+		g_static_mutex_lock(&job->lock);
+		if (job->err || job->next_piece >= job->pieces->len) {
+			g_static_mutex_unlock(&job->lock);
+			break;
+		}
+		piece = g_array_index(job->pieces, struct FillExtent, job->next_piece++);
+		g_static_mutex_unlock(&job->lock);
+
+		off_t done = fill_copy_range(src_fd, job->dest_fd, piece.start, piece.end - piece.start, 
+				job->quitflag_atomic, fill_job_update, job);
+
+		/* Coming up short means the source got shorter on us */
+		if (done < 0)
+			err = (errno ? errno : EIO);
+		else if (done < piece.end - piece.start)
+			err = EIO;
+	}
+
+	if (src_fd >= 0)
+		close(src_fd);
+
+	g_static_mutex_lock(&job->lock);
+	if (err && !job->err)
+		job->err = err;
+	g_static_mutex_unlock(&job->lock);
+
+	return NULL;
+}
+
+static void add_pieces(GArray* pieces, off_t start, off_t end)
+{
+	while (start < end) {
+		struct FillExtent piece = { start, MIN(start + FILL_RANGE_SIZE, end) };
+		g_array_append_val(pieces, piece);
+		start = piece.end;
+	}
+}
+
+int fill_copy_missing(const char* src_path, int dest_fd, off_t file_size, struct FillProgress* have, 
+		guint streams, gint* quitflag_atomic, FillProgressFunc progress, gpointer context)
+{
+	/* NOTE: have isn't updated here, that's up to progress */
+	struct FillJob job;
+	GPtrArray* threads;
+	off_t pos = 0;
+	guint i;
+
+	memset(&job, 0, sizeof(job));
+	job.src_path = src_path;  job.dest_fd = dest_fd;
+	job.quitflag_atomic = quitflag_atomic;
+	job.progress = progress;  job.context = context;
+	job.pieces = g_array_new(FALSE, FALSE, sizeof(struct FillExtent));
+	g_static_mutex_init(&job.lock);
+
+	/* Cut up everything we don't have yet */
+	if (have) {
+		g_static_mutex_lock(&have->lock);
+		for(i=0; i < have->extents->len && pos < file_size; i++) {
+			struct FillExtent* cur = &g_array_index(have->extents, struct FillExtent, i);
+			add_pieces(job.pieces, pos, MIN(cur->start, file_size));
+			pos = MAX(pos, cur->end);
+		}
+		g_static_mutex_unlock(&have->lock);
+	}
+	add_pieces(job.pieces, pos, file_size);
+
+#ifdef HAVE_FALLOCATE
+	/* Grab all the space up front, so the pieces don't fragment the file
+	 * and we find out now if it isn't going to fit */
+	if (job.pieces->len > 1 && fallocate(dest_fd, 0, 0, file_size) < 0 && errno == ENOSPC)
+		job.err = ENOSPC;
+#endif
+
+	/* Only bother with threads if there's more than one piece */
+	streams = MAX(1, MIN(streams, job.pieces->len));
+	threads = g_ptr_array_new();
+	for(i=1; i < streams && !job.err; i++) {
+		GThread* thread = g_thread_create(fill_job_thread, &job, TRUE, NULL);
+		if (thread)
+			g_ptr_array_add(threads, thread);
+	}
+	if (!job.err)
+		fill_job_thread(&job);
+
+	for(i=0; i < threads->len; i++)
+		g_thread_join(g_ptr_array_index(threads, i));
+
+	g_ptr_array_free(threads, TRUE);
+	g_array_free(job.pieces, TRUE);
+	g_static_mutex_free(&job.lock);
+
+	if (job.err) {
+		errno = job.err;
+		return -1;
+	}
+	return 0;
+}
+
+
+/*
+ * Fill progress
+ */
+
+struct FillProgress* fill_progress_new(void)
+{
+	struct FillProgress* ret = g_new0(struct FillProgress, 1);
+	ret->refcnt = 1;
+	ret->dest_fd = -1;
+	ret->extents = g_array_new(FALSE, FALSE, sizeof(struct FillExtent));
+	g_static_mutex_init(&ret->lock);
+	return ret;
+}
+
+struct FillProgress* fill_progress_ref(struct FillProgress* progress)
+{
+	g_atomic_int_inc(&progress->refcnt);
+	return progress;
+}
+
+void fill_progress_unref(struct FillProgress* progress)
+{
+	if (!progress)
+		return;
+
+	if (g_atomic_int_dec_and_test(&progress->refcnt)) {
+		if (progress->dest_fd >= 0)
+			close(progress->dest_fd);
+		g_array_free(progress->extents, TRUE);
+		g_static_mutex_free(&progress->lock);
+		g_free(progress);
+	}
+}
+
+struct FillProgress* fill_progress_copy(struct FillProgress* progress)
+{
+	/* Just the ranges; the copy doesn't get an fd */
+	struct FillProgress* ret = fill_progress_new();
+
+	g_static_mutex_lock(&progress->lock);
+	g_array_append_vals(ret->extents, progress->extents->data, progress->extents->len);
+	g_static_mutex_unlock(&progress->lock);
+
+	return ret;
+}
+
+void fill_progress_set_fd(struct FillProgress* progress, int dest_fd)
+{
+	/* We keep our own fd, so readers can keep using the file after the
+	 * fill is done with it (and after it's been renamed into place) */
+	int fd = dup(dest_fd);
+	if (fd >= 0 && !g_atomic_int_compare_and_exchange(&progress->dest_fd, -1, fd))
+		close(fd);
+}
+
+void fill_progress_add(struct FillProgress* progress, off_t offset, off_t length)
+{
+	struct FillExtent to_add = { offset, offset + length };
+	guint i = 0;
+
+	if (length <= 0)
+		return;
+
+	g_static_mutex_lock(&progress->lock);
+
+	/* Skip everything that ends before we start */
+	while (i < progress->extents->len && g_array_index(progress->extents, struct FillExtent, i).end < to_add.start)
+		i++;
+
+	/* Swallow everything that overlaps or touches us */
+	while (i < progress->extents->len && g_array_index(progress->extents, struct FillExtent, i).start <= to_add.end) {
+		struct FillExtent* cur = &g_array_index(progress->extents, struct FillExtent, i);
+		to_add.start = MIN(to_add.start, cur->start);
+		to_add.end = MAX(to_add.end, cur->end);
+		g_array_remove_index(progress->extents, i);
+	}
+
+	g_array_insert_val(progress->extents, i, to_add);
+	g_static_mutex_unlock(&progress->lock);
+}
+
+static gboolean fill_progress_covers(struct FillProgress* progress, off_t offset, size_t size)
+{
+	gboolean ret = FALSE;
+	guint i;
+
+	g_static_mutex_lock(&progress->lock);
+	for(i=0; i < progress->extents->len; i++) {
+		struct FillExtent* cur = &g_array_index(progress->extents, struct FillExtent, i);
+		if (cur->start > offset)
+			break;
+		if (cur->end >= offset + (off_t)size) {
+			ret = TRUE;
+			break;
+		}
+	}
+	g_static_mutex_unlock(&progress->lock);
+
+	return ret;
+}
+
+int fill_progress_read(struct FillProgress* progress, char* buf, size_t size, off_t offset)
+{
+	/* We can only answer if we have the whole range - a short read would
+	 * look like EOF */
+	int fd;
+	if (!progress || (fd = g_atomic_int_get(&progress->dest_fd)) < 0 || 
+	    !fill_progress_covers(progress, offset, size)) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	return pread(fd, buf, size, offset);
+}
+
+
+/*
+ * Fill records
+ */
+
+int fill_record_save(const char* record_path, const char* relative_path, const struct stat* source_st, 
+		struct FillProgress* landed)
+{
+	struct FillRecordHeader h;
+	GArray* extents = g_array_new(FALSE, FALSE, sizeof(struct FillRecordExtent));
+	int ret = 0;
+	guint i;
+
+	if (landed) {
+		g_static_mutex_lock(&landed->lock);
+		for(i=0; i < landed->extents->len; i++) {
+			struct FillExtent* cur = &g_array_index(landed->extents, struct FillExtent, i);
+			struct FillRecordExtent to_add = { cur->start, cur->end };
+			g_array_append_val(extents, to_add);
+		}
+		g_static_mutex_unlock(&landed->lock);
+	}
+
+	h.magic = FILLRECORD_MAGIC;
+	h.version = FILLRECORD_VERSION;
+	h.path_len = strlen(relative_path);
+	h.file_size = source_st->st_size;
+	h.mtime = source_st->st_mtime;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+	h.mtime_nsec = source_st->st_mtim.tv_nsec;
+#else
+	h.mtime_nsec = 0;
+#endif
+	h.extent_count = extents->len;
+
+	/* Write it out to the side, then move it into place, so a crash
+	 * leaves either the old record or the new one */
+	size_t len = extents->len * sizeof(struct FillRecordExtent);
+	gchar* tmp_path = g_strdup_printf("%s.tmp", record_path);
+	int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	if (write(fd, &h, sizeof(h)) != sizeof(h) || write(fd, relative_path, h.path_len) != h.path_len ||
+	    write(fd, extents->data, len) != len) {
+		ret = -EIO;
+		close(fd);
+		unlink(tmp_path);
+		goto out;
+	}
+
+	close(fd);
+	if (rename(tmp_path, record_path) != 0)
+		ret = -errno;
+
+out:
+	g_array_free(extents, TRUE);
+	g_free(tmp_path);
+	return ret;
+}
+
+gboolean fill_record_load(const char* record_path, gchar** relative_path, struct stat* source_st, 
+		struct FillProgress* landed)
+{
+	/* NOTE: Only the size and mtime of source_st get filled in */
+	struct FillRecordHeader h;
+	struct FillRecordExtent* extents = NULL;
+	gboolean ret = FALSE;
+	gchar* path = NULL;
+	guint64 i;
+
+	int fd = open(record_path, O_RDONLY);
+	if (fd < 0)
+		return FALSE;
+
+	if (read(fd, &h, sizeof(h)) != sizeof(h) || h.magic != FILLRECORD_MAGIC || 
+	    h.version != FILLRECORD_VERSION || !h.path_len || h.path_len > 64 * 1024)
+		goto out;
+
+	path = g_malloc0(h.path_len + 1);
+	if (read(fd, path, h.path_len) != h.path_len)
+		goto out;
+
+	size_t len = h.extent_count * sizeof(struct FillRecordExtent);
+	if (h.extent_count > h.file_size / FILL_BUFFER_SIZE + 1024)
+		goto out;
+	extents = g_malloc0(len + 1);
+	if (read(fd, extents, len) != len)
+		goto out;
+
+	for(i=0; landed && i < h.extent_count; i++) {
+		if (extents[i].end > extents[i].start)
+			fill_progress_add(landed, extents[i].start, extents[i].end - extents[i].start);
+	}
+
+	*relative_path = path;  path = NULL;
+	memset(source_st, 0, sizeof(*source_st));
+	source_st->st_size = h.file_size;
+	source_st->st_mtime = h.mtime;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+	source_st->st_mtim.tv_nsec = h.mtime_nsec;
+#endif
+	ret = TRUE;
+
+out:
+	close(fd);
+	g_free(extents);
+	g_free(path);
+	return ret;
+}
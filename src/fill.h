@@ -0,0 +1,51 @@
+/*
+ * fill.h - Userspace video caching filesystem
+ *
+ * Copyright 2008 Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef _FILL_H
+#define _FILL_H
+
+#include "stdafx.h"
+
+typedef gboolean (*FillProgressFunc) (off_t offset, off_t length, gpointer context);
+
+struct FillProgress;
+
+off_t fill_copy_range(int src_fd, int dest_fd, off_t offset, off_t length, gint* quitflag_atomic, 
+		FillProgressFunc progress, gpointer context);
+int fill_copy_missing(const char* src_path, int dest_fd, off_t file_size, struct FillProgress* have, 
+		guint streams, gint* quitflag_atomic, FillProgressFunc progress, gpointer context);
+
+struct FillProgress* fill_progress_new(void);
+struct FillProgress* fill_progress_ref(struct FillProgress* progress);
+void fill_progress_unref(struct FillProgress* progress);
+struct FillProgress* fill_progress_copy(struct FillProgress* progress);
+void fill_progress_set_fd(struct FillProgress* progress, int dest_fd);
+void fill_progress_add(struct FillProgress* progress, off_t offset, off_t length);
+int fill_progress_read(struct FillProgress* progress, char* buf, size_t size, off_t offset);
+
+int fill_record_save(const char* record_path, const char* relative_path, const struct stat* source_st, 
+		struct FillProgress* landed);
+gboolean fill_record_load(const char* record_path, gchar** relative_path, struct stat* source_st, 
+		struct FillProgress* landed);
+
+#endif
@@ -0,0 +1,166 @@
+/*
+ * handletable.c - Open file handles, by path
+ *
+ * Copyright 2008 Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include "stdafx.h"
+#include "handletable.h"
+
+/* FUSE hands us back whatever we put in fi->fh, so reads never need to
+ * look a handle up at all; this table is only for finding every handle
+ * that's open on a given path (when a copy lands, or when the evictor
+ * wants to know if a file is in use). It's split into independently
+ * locked shards, so opens and closes on different files don't fight */
+
+#define HANDLETABLE_SHARDS 	16
+
+struct HandleTableShard {
+	/* Path => GPtrArray of handles */
+	GHashTable* table;
+	GStaticRWLock lock;
+};
+
+struct HandleTable {
+	struct HandleTableShard shards[HANDLETABLE_SHARDS];
+};
+
+static struct HandleTableShard* shard_for_path(struct HandleTable* this, const char* path)
+{
+	return &this->shards[g_str_hash(path) % HANDLETABLE_SHARDS];
+}
+
+static void free_handle_list(gpointer data)
+{
+	g_ptr_array_free(data, TRUE);
+}
+
+static void foreach_in_list(GPtrArray* list, GFunc func, gpointer context)
+{
+	guint i;
+	for(i=0; list && i < list->len; i++)
+		func(g_ptr_array_index(list, i), context);
+}
+
+struct HandleTable* handle_table_new(void)
+{
+	struct HandleTable* ret = g_new0(struct HandleTable, 1);
+	int i;
+
+	for(i=0; i < HANDLETABLE_SHARDS; i++) {
+		ret->shards[i].table = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, free_handle_list);
+		g_static_rw_lock_init(&ret->shards[i].lock);
+	}
+
+	return ret;
+}
+
+void handle_table_free(struct HandleTable* this)
+{
+	int i;
+	if (!this)
+		return;
+
+	for(i=0; i < HANDLETABLE_SHARDS; i++) {
+		g_hash_table_destroy(this->shards[i].table);
+		g_static_rw_lock_free(&this->shards[i].lock);
+	}
+	g_free(this);
+}
+
+void handle_table_insert(struct HandleTable* this, const char* path, gpointer handle)
+{
+	struct HandleTableShard* shard = shard_for_path(this, path);
+	GPtrArray* list;
+
+	g_static_rw_lock_writer_lock(&shard->lock);
+	if ( !(list = g_hash_table_lookup(shard->table, path)) ) {
+		list = g_ptr_array_new();
+		g_hash_table_insert(shard->table, g_strdup(path), list);
+	}
+	g_ptr_array_add(list, handle);
+	g_static_rw_lock_writer_unlock(&shard->lock);
+}
+
+gboolean handle_table_remove(struct HandleTable* this, const char* path, gpointer handle)
+{
+	struct HandleTableShard* shard = shard_for_path(this, path);
+	GPtrArray* list;
+	gboolean ret = FALSE;
+
+	g_static_rw_lock_writer_lock(&shard->lock);
+	if ( (list = g_hash_table_lookup(shard->table, path)) ) {
+		ret = g_ptr_array_remove_fast(list, handle);
+
+		/* Last one out, take the whole path with us */
+		if (list->len == 0)
+			g_hash_table_remove(shard->table, path);
+	}
+	g_static_rw_lock_writer_unlock(&shard->lock);
+
+	return ret;
+}
+
+gboolean handle_table_has_path(struct HandleTable* this, const char* path)
+{
+	struct HandleTableShard* shard = shard_for_path(this, path);
+	gboolean ret;
+
+	g_static_rw_lock_reader_lock(&shard->lock);
+	ret = (g_hash_table_lookup(shard->table, path) != NULL);
+	g_static_rw_lock_reader_unlock(&shard->lock);
+
+	return ret;
+}
+
+void handle_table_foreach_path(struct HandleTable* this, const char* path, GFunc func, gpointer context)
+{
+	/* NOTE: Handles can't go away while we hold the lock, but func
+	 * mustn't try to add or remove any */
+	struct HandleTableShard* shard = shard_for_path(this, path);
+
+	g_static_rw_lock_reader_lock(&shard->lock);
+	foreach_in_list(g_hash_table_lookup(shard->table, path), func, context);
+	g_static_rw_lock_reader_unlock(&shard->lock);
+}
+
+/* Stupid struct to pass a tuple through to this fn */
+struct foreach_context {
+	GFunc func;
+	gpointer context;
+};
+
+static void foreach_handle_list(gpointer key, gpointer val, gpointer foreach_context)
+{
+	struct foreach_context* ctx = foreach_context;
+	foreach_in_list(val, ctx->func, ctx->context);
+}
+
+void handle_table_foreach(struct HandleTable* this, GFunc func, gpointer context)
+{
+	struct foreach_context ctx = { func, context };
+	int i;
+
+	for(i=0; i < HANDLETABLE_SHARDS; i++) {
+		g_static_rw_lock_reader_lock(&this->shards[i].lock);
+		g_hash_table_foreach(this->shards[i].table, foreach_handle_list, &ctx);
+		g_static_rw_lock_reader_unlock(&this->shards[i].lock);
+	}
+}
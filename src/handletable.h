@@ -0,0 +1,39 @@
+/*
+ * handletable.h - Userspace video caching filesystem
+ *
+ * Copyright 2008 Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef _HANDLETABLE_H
+#define _HANDLETABLE_H
+
+#include "stdafx.h"
+
+struct HandleTable;
+
+struct HandleTable* handle_table_new(void);
+void handle_table_free(struct HandleTable* this);
+void handle_table_insert(struct HandleTable* this, const char* path, gpointer handle);
+gboolean handle_table_remove(struct HandleTable* this, const char* path, gpointer handle);
+gboolean handle_table_has_path(struct HandleTable* this, const char* path);
+void handle_table_foreach_path(struct HandleTable* this, const char* path, GFunc func, gpointer context);
+void handle_table_foreach(struct HandleTable* this, GFunc func, gpointer context);
+
+#endif
@@ -0,0 +1,240 @@
+/*
+ * inodetable.c - Inode numbers for the low-level FUSE frontend
+ *
+ * Copyright 2008 Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+#include "stdafx.h"
+#include "inodetable.h"
+
+/* The low-level FUSE API talks in inode numbers instead of paths, so we
+ * hand out a number for every name the kernel looks up and remember it
+ * until the kernel forgets it. Each inode knows its parent and its name,
+ * and since the mount is read-only, its path never changes; we build it
+ * once and hand out that same string from then on. We also keep the size
+ * and mtime we last told the kernel about, so the frontend can tell when
+ * the source has changed underneath it */
+
+struct Inode {
+	gint refcnt;
+	guint64 ino;
+	guint64 nlookup;
+
+	struct Inode* parent;
+	char* name;
+	char* path;
+
+	/* Name => Inode, for children the kernel still knows about. These
+	 * don't hold a ref; a child pulls itself out when it's forgotten */
+	GHashTable* children;
+
+	gboolean has_attr;
+	off_t size;
+	time_t mtime;
+};
+
+struct InodeTable {
+	guint64 next_ino;
+
+	/* Inode number => Inode; holds a ref on each. Numbers are never
+	 * reused, so they fit in a pointer long before they run out */
+	GHashTable* inodes;
+	struct Inode* root;
+	GStaticMutex lock;
+};
+
+static struct Inode* inode_new(guint64 ino, struct Inode* parent, const char* name)
+{
+	struct Inode* ret = g_new0(struct Inode, 1);
+	ret->refcnt = 1;
+	ret->ino = ino;
+	ret->name = g_strdup(name);
+	ret->children = g_hash_table_new(g_str_hash, g_str_equal);
+
+	if (parent) {
+		ret->parent = inode_ref(parent);
+		ret->path = inode_build_child_path(parent, name);
+	} else {
+		ret->path = g_strdup("/");
+	}
+
+	return ret;
+}
+
+struct Inode* inode_ref(struct Inode* inode)
+{
+	g_atomic_int_inc(&inode->refcnt);
+	return inode;
+}
+
+void inode_unref(struct Inode* inode)
+{
+	if (!inode || !g_atomic_int_dec_and_test(&inode->refcnt))
+		return;
+
+	inode_unref(inode->parent);
+	g_hash_table_destroy(inode->children);
+	g_free(inode->name);
+	g_free(inode->path);
+	g_free(inode);
+}
+
+guint64 inode_get_ino(struct Inode* inode)
+{
+	return inode->ino;
+}
+
+const char* inode_get_path(struct Inode* inode)
+{
+	return inode->path;
+}
+
+const char* inode_get_name(struct Inode* inode)
+{
+	return inode->name;
+}
+
+struct Inode* inode_get_parent(struct Inode* inode)
+{
+	return inode->parent;
+}
+
+char* inode_build_child_path(struct Inode* parent, const char* name)
+{
+	/* Relative paths keep their leading slash, so the root is special */
+	if (!parent->parent)
+		return g_strdup_printf("/%s", name);
+	return g_strdup_printf("%s/%s", parent->path, name);
+}
+
+struct InodeTable* inode_table_new(void)
+{
+	struct InodeTable* ret = g_new0(struct InodeTable, 1);
+	if (!ret)
+		return NULL;
+
+	ret->inodes = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)inode_unref);
+	g_static_mutex_init(&ret->lock);
+
+	/* The kernel never looks up or forgets the root, it just knows */
+	ret->root = inode_new(INODE_ROOT, NULL, "/");
+	ret->next_ino = INODE_ROOT + 1;
+	g_hash_table_insert(ret->inodes, GSIZE_TO_POINTER(ret->root->ino), ret->root);
+
+	return ret;
+}
+
+void inode_table_free(struct InodeTable* this)
+{
+	if (!this)
+		return;
+
+	g_hash_table_destroy(this->inodes);
+	g_static_mutex_free(&this->lock);
+	g_free(this);
+}
+
+struct Inode* inode_table_get(struct InodeTable* this, guint64 ino)
+{
+	struct Inode* ret;
+
+	g_static_mutex_lock(&this->lock);
+	if ( (ret = g_hash_table_lookup(this->inodes, GSIZE_TO_POINTER(ino))) )
+		inode_ref(ret);
+	g_static_mutex_unlock(&this->lock);
+
+	return ret;
+}
+
+struct Inode* inode_table_remember(struct InodeTable* this, struct Inode* parent, const char* name)
+{
+	struct Inode* ret;
+
+	/* Every entry we hand back counts as a lookup that the kernel will
+	 * eventually forget, whether the inode is new or not */
+	g_static_mutex_lock(&this->lock);
+	if ( !(ret = g_hash_table_lookup(parent->children, name)) ) {
+		ret = inode_new(this->next_ino++, parent, name);
+		g_hash_table_insert(this->inodes, GSIZE_TO_POINTER(ret->ino), ret);
+		g_hash_table_insert(parent->children, ret->name, ret);
+	}
+
+	ret->nlookup++;
+	inode_ref(ret);
+	g_static_mutex_unlock(&this->lock);
+
+	return ret;
+}
+
+void inode_table_forget(struct InodeTable* this, guint64 ino, guint64 nlookup)
+{
+	struct Inode* inode;
+
+	g_static_mutex_lock(&this->lock);
+
+	inode = g_hash_table_lookup(this->inodes, GSIZE_TO_POINTER(ino));
+	if (!inode || inode == this->root) 
+		goto out;
+
+	inode->nlookup -= MIN(nlookup, inode->nlookup);
+	if (inode->nlookup > 0)
+		goto out;
+
+	/* NOTE: If someone's still holding a ref, the inode lives on without
+	 * a number; a later lookup of the same name just gets a new one */
+	if (g_hash_table_lookup(inode->parent->children, inode->name) == inode)
+		g_hash_table_remove(inode->parent->children, inode->name);
+	g_hash_table_remove(this->inodes, GSIZE_TO_POINTER(ino));
+
+out:
+	g_static_mutex_unlock(&this->lock);
+}
+
+struct Inode* inode_table_lookup_path(struct InodeTable* this, const char* path)
+{
+	struct Inode* ret = this->root;
+	gchar** parts = g_strsplit(path, "/", 0);
+	int i;
+
+	g_static_mutex_lock(&this->lock);
+	for(i=0; ret && parts[i]; i++) {
+		if (*parts[i])
+			ret = g_hash_table_lookup(ret->children, parts[i]);
+	}
+	if (ret)
+		inode_ref(ret);
+	g_static_mutex_unlock(&this->lock);
+
+	g_strfreev(parts);
+	return ret;
+}
+
+gboolean inode_table_update_attr(struct InodeTable* this, struct Inode* inode, const struct stat* st)
+{
+	gboolean changed;
+
+	g_static_mutex_lock(&this->lock);
+	changed = (inode->has_attr && (inode->size != st->st_size || inode->mtime != st->st_mtime));
+	inode->has_attr = TRUE;
+	inode->size = st->st_size;
+	inode->mtime = st->st_mtime;
+	g_static_mutex_unlock(&this->lock);
+
+	return changed;
+}
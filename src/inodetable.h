@@ -0,0 +1,50 @@
+/*
+ * inodetable.h - Userspace video caching filesystem
+ *
+ * Copyright 2008 Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef _INODETABLE_H
+#define _INODETABLE_H
+
+#include "stdafx.h"
+
+#define INODE_ROOT 	1
+
+struct InodeTable;
+struct Inode;
+
+struct InodeTable* inode_table_new(void);
+void inode_table_free(struct InodeTable* this);
+struct Inode* inode_table_get(struct InodeTable* this, guint64 ino);
+struct Inode* inode_table_remember(struct InodeTable* this, struct Inode* parent, const char* name);
+struct Inode* inode_table_lookup_path(struct InodeTable* this, const char* path);
+void inode_table_forget(struct InodeTable* this, guint64 ino, guint64 nlookup);
+gboolean inode_table_update_attr(struct InodeTable* this, struct Inode* inode, const struct stat* st);
+
+struct Inode* inode_ref(struct Inode* inode);
+void inode_unref(struct Inode* inode);
+guint64 inode_get_ino(struct Inode* inode);
+const char* inode_get_path(struct Inode* inode);
+const char* inode_get_name(struct Inode* inode);
+struct Inode* inode_get_parent(struct Inode* inode);
+char* inode_build_child_path(struct Inode* parent, const char* name);
+
+#endif
@@ -0,0 +1,525 @@
+/*
+ * lowlevel.c - Inode-based FUSE frontend
+ *
+ * Copyright 2008 Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include "stdafx.h"
+
+#include <fuse_lowlevel.h>
+
+#include "vcachefs.h"
+#include "stats.h"
+#include "queue.h"
+#include "inodetable.h"
+
+/* The path-based FUSE API turns every request into a path, walking the
+ * kernel's dentries and taking the big tree lock to do it. Here the kernel
+ * hands us inode numbers, we keep the name for each, and we get to tell
+ * the kernel how long it can trust what we said: entries and attributes
+ * (including 'not found') live as long as the attribute cache does, and
+ * when we notice that a file has changed or gone away, we tell the kernel
+ * to throw out what it knows about it */
+
+struct vcachefs_lowlevel {
+	struct vcachefs_mount* mount;
+	struct InodeTable* inodes;
+	struct fuse_chan* chan;
+};
+
+/* A directory listing, built when the directory is opened */
+struct dirbuf {
+	fuse_req_t req;
+	char* p;
+	size_t size;
+};
+
+/* Stupid struct to pass a tuple through to this fn */
+struct inval_item {
+	struct fuse_chan* chan;
+	fuse_ino_t ino;
+	char* name;
+};
+
+/* Stupid struct to pass a tuple through to this fn */
+struct dir_change_item {
+	struct vcachefs_lowlevel* ll;
+	fuse_ino_t ino;
+	char* path;
+	struct DirSnapshot* old;
+	GHashTable* names;
+};
+
+static struct vcachefs_lowlevel* get_lowlevel(fuse_req_t req)
+{
+	return fuse_req_userdata(req);
+}
+
+static struct Inode* inode_from_req(fuse_req_t req, fuse_ino_t ino)
+{
+	struct Inode* ret = inode_table_get(get_lowlevel(req)->inodes, ino);
+	if (!ret)
+		fuse_reply_err(req, ENOENT);
+	return ret;
+}
+
+/*
+ * Invalidation
+ */
+
+static void inval_item_free(gpointer data)
+{
+	struct inval_item* item = data;
+	g_free(item->name);
+	g_free(item);
+}
+
+static void invalidate_workitem(gpointer data, gpointer dontcare)
+{
+	struct inval_item* item = data;
+
+	/* NOTE: The kernel may be holding locks waiting on the request that
+	 * noticed the change, so these can't be sent from inside it */
+	if (item->name)
+		fuse_lowlevel_notify_inval_entry(item->chan, item->ino, item->name, strlen(item->name));
+	else
+		fuse_lowlevel_notify_inval_inode(item->chan, item->ino, 0, 0);
+
+	inval_item_free(item);
+}
+
+static void queue_invalidate(struct vcachefs_lowlevel* ll, fuse_ino_t ino, const char* name)
+{
+	struct inval_item* item;
+	if (!ll->chan)
+		return;
+
+	item = g_new0(struct inval_item, 1);
+	item->chan = ll->chan;
+	item->ino = ino;
+	item->name = g_strdup(name);
+	workitem_queue_insert(ll->mount->work_queue, invalidate_workitem, item, NULL, inval_item_free);
+}
+
+static void dir_change_item_free(gpointer data)
+{
+	struct dir_change_item* item = data;
+	dir_snapshot_unref(item->old);
+	if (item->names)
+		g_hash_table_destroy(item->names);
+	g_free(item->path);
+	g_free(item);
+}
+
+static int collect_name(const char* name, const struct stat* st, gpointer names)
+{
+	g_hash_table_insert(names, g_strdup(name), GINT_TO_POINTER(1));
+	return 0;
+}
+
+static int invalidate_if_removed(const char* name, const struct stat* st, gpointer dir_change_item)
+{
+	/* Whatever's left in names afterwards is new */
+	struct dir_change_item* item = dir_change_item;
+	if (!g_hash_table_remove(item->names, name))
+		queue_invalidate(item->ll, item->ino, name);
+	return 0;
+}
+
+static void invalidate_if_added(gpointer key, gpointer val, gpointer dir_change_item)
+{
+	struct dir_change_item* item = dir_change_item;
+	queue_invalidate(item->ll, item->ino, key);
+}
+
+static void dir_changed_workitem(gpointer data, gpointer dontcare)
+{
+	/* List the directory again, and tell the kernel about every name that
+	 * came or went since the last time, so it drops any entries (and 'not
+	 * found's) it has for them */
+	struct dir_change_item* item = data;
+
+	item->names = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	if (vcachefs_mount_readdir(item->ll->mount, item->path, collect_name, item->names) == 0) {
+		g_hash_table_remove(item->names, ".");
+		g_hash_table_remove(item->names, "..");
+		dir_snapshot_foreach(item->old, invalidate_if_removed, item);
+		g_hash_table_foreach(item->names, invalidate_if_added, item);
+	}
+
+	dir_change_item_free(item);
+}
+
+static void queue_dir_changed(struct vcachefs_lowlevel* ll, struct Inode* inode)
+{
+	struct dir_change_item* item;
+	const char* path = inode_get_path(inode);
+	struct DirSnapshot* old = dir_cache_lookup(ll->mount->dir_cache, path);
+
+	/* Either way, the listing we had is no good anymore */
+	dir_cache_invalidate(ll->mount->dir_cache, path);
+	if (!old)
+		return;
+	if (!ll->chan) {
+		dir_snapshot_unref(old);
+		return;
+	}
+
+	item = g_new0(struct dir_change_item, 1);
+	item->ll = ll;
+	item->ino = inode_get_ino(inode);
+	item->path = g_strdup(path);
+	item->old = old;
+	workitem_queue_insert(ll->mount->work_queue, dir_changed_workitem, item, NULL, dir_change_item_free);
+}
+
+static void check_for_changes(struct vcachefs_lowlevel* ll, struct Inode* inode, int err, struct stat* st)
+{
+	struct Inode* parent = inode_get_parent(inode);
+
+	if (err == -ENOENT && parent) {
+		queue_invalidate(ll, inode_get_ino(parent), inode_get_name(inode));
+		return;
+	}
+
+	if (err == 0 && inode_table_update_attr(ll->inodes, inode, st)) {
+		queue_invalidate(ll, inode_get_ino(inode), NULL);
+		if (S_ISDIR(st->st_mode))
+			queue_dir_changed(ll, inode);
+	}
+}
+
+static void invalidate_path(const char* relative_path, gpointer context)
+{
+	/* If the kernel doesn't know about it, it can't have cached it */
+	struct vcachefs_lowlevel* ll = context;
+	struct Inode* inode = inode_table_lookup_path(ll->inodes, relative_path);
+	if (!inode)
+		return;
+
+	queue_invalidate(ll, inode_get_ino(inode), NULL);
+	inode_unref(inode);
+}
+
+/*
+ * FUSE callouts
+ */
+
+static void vcachefs_ll_init(void* userdata, struct fuse_conn_info* conn)
+{
+	struct vcachefs_lowlevel* ll = userdata;
+
+	/* Cached reads get spliced out of the cache file */
+	conn->want |= (conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE));
+
+	ll->inodes = inode_table_new();
+	ll->mount = vcachefs_mount_new();
+	ll->mount->invalidate_context = ll;
+	ll->mount->invalidate = invalidate_path;
+}
+
+static void vcachefs_ll_destroy(void* userdata)
+{
+	struct vcachefs_lowlevel* ll = userdata;
+	ll->mount->invalidate = NULL;
+	vcachefs_mount_free(ll->mount);
+	inode_table_free(ll->inodes);
+	ll->mount = NULL;
+	ll->inodes = NULL;
+}
+
+static void vcachefs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+	struct vcachefs_lowlevel* ll = get_lowlevel(req);
+	struct fuse_entry_param e;
+	struct Inode* parent_inode;
+	struct Inode* inode;
+	char* path;
+	int ret;
+
+	if ( !(parent_inode = inode_from_req(req, parent)) )
+		return;
+
+	memset(&e, 0, sizeof(e));
+	path = inode_build_child_path(parent_inode, name);
+	ret = vcachefs_mount_getattr(ll->mount, path, &e.attr);
+	g_free(path);
+
+	if (ret == -ENOENT) {
+		/* A zero inode tells the kernel to remember that it's not there */
+		e.entry_timeout = ll->mount->negative_ttl;
+		fuse_reply_entry(req, &e);
+		goto out;
+	}
+
+	if (ret) {
+		fuse_reply_err(req, -ret);
+		goto out;
+	}
+
+	inode = inode_table_remember(ll->inodes, parent_inode, name);
+	check_for_changes(ll, inode, 0, &e.attr);
+
+	e.ino = inode_get_ino(inode);
+	e.attr.st_ino = e.ino;
+	e.attr_timeout = e.entry_timeout = ll->mount->attr_ttl;
+	if (fuse_reply_entry(req, &e) != 0)
+		inode_table_forget(ll->inodes, e.ino, 1);
+	inode_unref(inode);
+
+out:
+	inode_unref(parent_inode);
+}
+
+static void vcachefs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+	inode_table_forget(get_lowlevel(req)->inodes, ino, nlookup);
+	fuse_reply_none(req);
+}
+
+static void vcachefs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+	struct vcachefs_lowlevel* ll = get_lowlevel(req);
+	struct Inode* inode;
+	struct stat st;
+	int ret;
+
+	if ( !(inode = inode_from_req(req, ino)) )
+		return;
+
+	ret = vcachefs_mount_getattr(ll->mount, inode_get_path(inode), &st);
+	check_for_changes(ll, inode, ret, &st);
+
+	if (ret) {
+		fuse_reply_err(req, -ret);
+	} else {
+		st.st_ino = ino;
+		fuse_reply_attr(req, &st, ll->mount->attr_ttl);
+	}
+
+	inode_unref(inode);
+}
+
+static void vcachefs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+	struct vcachefs_lowlevel* ll = get_lowlevel(req);
+	struct vcachefs_fdentry* fde = NULL;
+	struct Inode* inode;
+	int ret;
+
+	if ( !(inode = inode_from_req(req, ino)) )
+		return;
+
+	ret = vcachefs_mount_open(ll->mount, inode_get_path(inode), fi->flags, &fde);
+	inode_unref(inode);
+
+	if (ret) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+
+	/* If the open got interrupted, nobody's ever going to release this */
+	fi->fh = (gsize)fde;
+	fi->keep_cache = vcachefs_mount_keep_cache(ll->mount, fde);
+	if (fuse_reply_open(req, fi) != 0)
+		vcachefs_mount_release(ll->mount, fde);
+}
+
+static void vcachefs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info* fi)
+{
+	struct vcachefs_lowlevel* ll = get_lowlevel(req);
+	struct vcachefs_fdentry* fde = (struct vcachefs_fdentry*)(gsize)fi->fh;
+	char* buf;
+	int ret, fd;
+
+	if ( (fd = vcachefs_mount_read_fd(ll->mount, fde, &size, off)) >= 0) {
+		struct fuse_bufvec bv = FUSE_BUFVEC_INIT(size);
+		bv.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		bv.buf[0].fd = fd;
+		bv.buf[0].pos = off;
+		fuse_reply_data(req, &bv, FUSE_BUF_SPLICE_MOVE);
+		return;
+	}
+
+	buf = g_malloc(size);
+	ret = vcachefs_mount_read(ll->mount, fde, buf, size, off);
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_buf(req, buf, ret);
+
+	g_free(buf);
+}
+
+static void vcachefs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+	int ret = vcachefs_mount_release(get_lowlevel(req)->mount, (struct vcachefs_fdentry*)(gsize)fi->fh);
+	fi->fh = 0;
+	fuse_reply_err(req, -ret);
+}
+
+static int add_to_dirbuf(const char* name, const struct stat* st, gpointer context)
+{
+	struct dirbuf* b = context;
+	struct stat empty;
+	size_t oldsize = b->size;
+
+	if (!st) {
+		memset(&empty, 0, sizeof(empty));
+		st = &empty;
+	}
+
+	/* Each entry's offset is where the next one starts */
+	b->size += fuse_add_direntry(b->req, NULL, 0, name, NULL, 0);
+	b->p = g_realloc(b->p, b->size);
+	fuse_add_direntry(b->req, b->p + oldsize, b->size - oldsize, name, st, b->size);
+	return 0;
+}
+
+static void vcachefs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+	struct vcachefs_lowlevel* ll = get_lowlevel(req);
+	struct dirbuf* b;
+	struct Inode* inode;
+	int ret;
+
+	if ( !(inode = inode_from_req(req, ino)) )
+		return;
+
+	/* We read the whole thing up front, so a listing doesn't change out
+	 * from under someone who's partway through it */
+	b = g_new0(struct dirbuf, 1);
+	b->req = req;
+	ret = vcachefs_mount_readdir(ll->mount, inode_get_path(inode), add_to_dirbuf, b);
+	inode_unref(inode);
+
+	if (ret) {
+		g_free(b->p);
+		g_free(b);
+		fuse_reply_err(req, -ret);
+		return;
+	}
+
+	fi->fh = (gsize)b;
+	if (fuse_reply_open(req, fi) != 0) {
+		g_free(b->p);
+		g_free(b);
+	}
+}
+
+static void vcachefs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info* fi)
+{
+	struct dirbuf* b = (struct dirbuf*)(gsize)fi->fh;
+
+	if (off >= b->size)
+		fuse_reply_buf(req, NULL, 0);
+	else
+		fuse_reply_buf(req, b->p + off, MIN(b->size - off, size));
+}
+
+static void vcachefs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+	struct dirbuf* b = (struct dirbuf*)(gsize)fi->fh;
+	g_free(b->p);
+	g_free(b);
+	fuse_reply_err(req, 0);
+}
+
+static void vcachefs_ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	struct statvfs st;
+	int ret = vcachefs_mount_statfs(get_lowlevel(req)->mount, &st);
+
+	if (ret)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_statfs(req, &st);
+}
+
+static void vcachefs_ll_access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+	struct Inode* inode;
+	int ret;
+
+	if ( !(inode = inode_from_req(req, ino)) )
+		return;
+
+	ret = vcachefs_mount_access(get_lowlevel(req)->mount, inode_get_path(inode), mask);
+	inode_unref(inode);
+	fuse_reply_err(req, -ret);
+}
+
+static struct fuse_lowlevel_ops vcachefs_ll_oper = {
+	.init 		= vcachefs_ll_init,
+	.destroy 	= vcachefs_ll_destroy,
+	.lookup 	= vcachefs_ll_lookup,
+	.forget 	= vcachefs_ll_forget,
+	.getattr 	= vcachefs_ll_getattr,
+	.open 		= vcachefs_ll_open,
+	.read 		= vcachefs_ll_read,
+	.release 	= vcachefs_ll_release,
+	.opendir 	= vcachefs_ll_opendir,
+	.readdir 	= vcachefs_ll_readdir,
+	.releasedir 	= vcachefs_ll_releasedir,
+	.statfs 	= vcachefs_ll_statfs,
+	.access 	= vcachefs_ll_access,
+};
+
+/*
+ * Main
+ */
+
+int vcachefs_lowlevel_main(int argc, char *argv[])
+{
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct vcachefs_lowlevel ll;
+	struct fuse_session* se;
+	char* mountpoint = NULL;
+	int multithreaded, foreground;
+	int ret = 1;
+
+	/* There's no fuse_context down here, so don't go looking for one */
+	stats_disable_fuse_context();
+	memset(&ll, 0, sizeof(ll));
+
+	if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) < 0 || !mountpoint)
+		goto out;
+
+	if ( !(ll.chan = fuse_mount(mountpoint, &args)) )
+		goto out;
+
+	if ( (se = fuse_lowlevel_new(&args, &vcachefs_ll_oper, sizeof(vcachefs_ll_oper), &ll)) ) {
+		if (fuse_set_signal_handlers(se) == 0) {
+			fuse_session_add_chan(se, ll.chan);
+			fuse_daemonize(foreground);
+			ret = (multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se));
+			fuse_remove_signal_handlers(se);
+			fuse_session_remove_chan(ll.chan);
+		}
+		fuse_session_destroy(se);
+	}
+
+	fuse_unmount(mountpoint, ll.chan);
+
+out:
+	free(mountpoint);
+	fuse_opt_free_args(&args);
+	return (ret ? 1 : 0);
+}
@@ -0,0 +1,305 @@
+/*
+ * metacache.c - Head/tail cache for tag scanners
+ *
+ * Copyright 2008 Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include "stdafx.h"
+#include "metacache.h"
+#include "cachemgr.h"
+
+/* Media library scanners only ever look at the ends of a file - ID3v2 at
+ * the front, ID3v1/APE at the back, and the MP4 'moov' atom at either end.
+ * For every file we see, we save off the first head_size and last tail_size
+ * bytes into one small file named after the MD5 of the relative path, so
+ * that a rescan never has to touch the network (or copy the whole file).
+ * A CacheManager keeps track of the entries, so that once there are more
+ * of them than the budget allows, the least used ones go */
+
+#define METAENTRY_MAGIC 	0x544d4356 	/* 'VCMT' */
+#define METAENTRY_VERSION 	1
+
+struct MetaEntryHeader {
+	guint32 magic;
+	guint32 version;
+	guint64 file_size;
+	gint64 	mtime;
+	guint64 head_len;
+	guint64 tail_offset;
+	guint64 tail_len;
+};
+
+struct MetaCache {
+	char* cache_root;
+	guint head_size;
+	guint tail_size;
+
+	/* Relative paths that someone is currently filling */
+	GHashTable* filling;
+	GStaticMutex filling_lock;
+
+	struct CacheManager* cache_manager;
+};
+
+struct MetaCacheEntry {
+	int fd;
+	struct MetaEntryHeader h;
+};
+
+static char* entry_path(struct MetaCache* this, const char* relative_path)
+{
+	gchar* sum = g_compute_checksum_for_string(G_CHECKSUM_MD5, relative_path, -1);
+	gchar* ret = g_build_filename(this->cache_root, sum, NULL);
+	g_free(sum);
+	return ret;
+}
+
+static void compute_windows(struct MetaCache* this, off_t file_size, off_t* head_len, off_t* tail_offset)
+{
+	/* If the windows overlap, the whole file gets stored in order */
+	*head_len = MIN(file_size, this->head_size);
+	*tail_offset = MAX(*head_len, file_size - (off_t)this->tail_size);
+}
+
+static int read_fully(int fd, char* buf, size_t size, off_t offset)
+{
+	size_t has_read = 0;
+	while (has_read < size) {
+		ssize_t tmp = pread(fd, buf + has_read, size - has_read, offset + has_read);
+		if (tmp < 0 && errno == EINTR)
+			continue;
+		if (tmp <= 0)
+			return -1;
+		has_read += tmp;
+	}
+	return 0;
+}
+
+static void filter_deletable_entries(const char** paths, gboolean* deletable, guint count, gpointer dontcare)
+{
+	/* Readers keep their own fd, so pulling an entry out from under them
+	 * is fine */
+	guint i;
+	for(i=0; i < count; i++)
+		deletable[i] = TRUE;
+}
+
+struct MetaCache* meta_cache_new(const char* cache_root, guint head_size, guint tail_size)
+{
+	struct MetaCache* ret = g_new0(struct MetaCache, 1);
+	if (!ret)
+		goto failed;
+
+	ret->cache_root = g_strdup(cache_root);
+	ret->head_size = head_size;
+	ret->tail_size = tail_size;
+	if (g_mkdir_with_parents(ret->cache_root, 5+7*8+7*8*8) != 0)
+		goto failed;
+
+	ret->filling = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	g_static_mutex_init(&ret->filling_lock);
+	ret->cache_manager = cache_manager_new(ret->cache_root, NULL, 0, filter_deletable_entries, ret);
+
+	return ret;
+
+failed:
+	if (ret) {
+		g_free(ret->cache_root);
+		g_free(ret);
+	}
+	return NULL;
+}
+
+void meta_cache_start_evictor(struct MetaCache* this, guint64 high_watermark, guint64 low_watermark)
+{
+	if (this && this->cache_manager)
+		cache_manager_start_evictor(this->cache_manager, high_watermark, low_watermark);
+}
+
+void meta_cache_free(struct MetaCache* this)
+{
+	if (!this)
+		return;
+
+	cache_manager_free(this->cache_manager);
+	g_hash_table_destroy(this->filling);
+	g_free(this->cache_root);
+	g_free(this);
+}
+
+gboolean meta_cache_covers(struct MetaCache* this, off_t file_size, size_t size, off_t offset)
+{
+	off_t head_len, tail_offset;
+	if (!this)
+		return FALSE;
+
+	compute_windows(this, file_size, &head_len, &tail_offset);
+	off_t end = MIN(offset + (off_t)size, file_size);
+
+	return (end <= head_len || offset >= tail_offset || head_len == tail_offset);
+}
+
+struct MetaCacheEntry* meta_cache_lookup(struct MetaCache* this, const char* relative_path, const struct stat* source_st)
+{
+	struct MetaCacheEntry* ret = NULL;
+	if (!this)
+		return NULL;
+
+	char* path = entry_path(this, relative_path);
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		g_free(path);
+		return NULL;
+	}
+
+	ret = g_new0(struct MetaCacheEntry, 1);
+	ret->fd = fd;
+	if (read(fd, &ret->h, sizeof(ret->h)) != sizeof(ret->h))
+		goto failed;
+
+	/* Make sure this is one of ours, and that the source hasn't changed */
+	if (ret->h.magic != METAENTRY_MAGIC || ret->h.version != METAENTRY_VERSION ||
+	    ret->h.file_size != source_st->st_size || ret->h.mtime != source_st->st_mtime)
+		goto failed;
+
+	cache_manager_touch_file(this->cache_manager, path);
+	g_free(path);
+	return ret;
+
+failed:
+	g_free(path);
+	meta_cache_entry_free(ret);
+	return NULL;
+}
+
+int meta_cache_fill(struct MetaCache* this, const char* relative_path, int source_fd)
+{
+	struct stat st;
+	struct MetaCacheEntry* existing;
+	struct MetaEntryHeader h;
+	off_t head_len, tail_offset;
+	char* buf = NULL;
+	char* path = NULL;
+	char* tmp_path = NULL;
+	int fd = -1, ret = 0;
+
+	if (!this)
+		return -EINVAL;
+	if (fstat(source_fd, &st) != 0)
+		return -errno;
+	if (!S_ISREG(st.st_mode))
+		return -EINVAL;
+
+	/* Only one thread needs to go fetch this */
+	g_static_mutex_lock(&this->filling_lock);
+	if (g_hash_table_lookup(this->filling, relative_path)) {
+		g_static_mutex_unlock(&this->filling_lock);
+		return 0;
+	}
+	g_hash_table_insert(this->filling, g_strdup(relative_path), GINT_TO_POINTER(1));
+	g_static_mutex_unlock(&this->filling_lock);
+
+	/* Someone may have beaten us to it */
+	if ( (existing = meta_cache_lookup(this, relative_path, &st)) ) {
+		meta_cache_entry_free(existing);
+		goto out;
+	}
+
+	compute_windows(this, st.st_size, &head_len, &tail_offset);
+	h.magic = METAENTRY_MAGIC;
+	h.version = METAENTRY_VERSION;
+	h.file_size = st.st_size;
+	h.mtime = st.st_mtime;
+	h.head_len = head_len;
+	h.tail_offset = tail_offset;
+	h.tail_len = st.st_size - tail_offset;
+
+	size_t len = h.head_len + h.tail_len;
+	buf = g_malloc(len + 1);
+	if (read_fully(source_fd, buf, h.head_len, 0) != 0 ||
+	    read_fully(source_fd, buf + h.head_len, h.tail_len, h.tail_offset) != 0) {
+		ret = -EIO;
+		goto out;
+	}
+
+	/* Write the entry out to the side, then move it into place */
+	path = entry_path(this, relative_path);
+	tmp_path = g_strdup_printf("%s.tmp", path);
+	if ((fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	if (write(fd, &h, sizeof(h)) != sizeof(h) || write(fd, buf, len) != len) {
+		ret = -EIO;
+		unlink(tmp_path);
+		goto out;
+	}
+
+	if (rename(tmp_path, path) != 0)
+		ret = -errno;
+	else
+		cache_manager_notify_added(this->cache_manager, path);
+
+out:
+	if (fd >= 0)
+		close(fd);
+	g_free(buf);
+	g_free(path);
+	g_free(tmp_path);
+
+	g_static_mutex_lock(&this->filling_lock);
+	g_hash_table_remove(this->filling, relative_path);
+	g_static_mutex_unlock(&this->filling_lock);
+
+	return ret;
+}
+
+void meta_cache_entry_free(struct MetaCacheEntry* entry)
+{
+	if (!entry)
+		return;
+
+	if (entry->fd >= 0)
+		close(entry->fd);
+	g_free(entry);
+}
+
+int meta_cache_entry_read(struct MetaCacheEntry* entry, char* buf, size_t size, off_t offset)
+{
+	off_t data_offset;
+	if (!entry)
+		return -1;
+
+	if (offset >= entry->h.file_size)
+		return 0;
+	size = MIN(size, entry->h.file_size - offset);
+
+	/* Figure out where in our file this range lives, if we have it at all */
+	if (offset + size <= entry->h.head_len || entry->h.head_len == entry->h.tail_offset) {
+		data_offset = offset;
+	} else if (offset >= entry->h.tail_offset) {
+		data_offset = entry->h.head_len + (offset - entry->h.tail_offset);
+	} else {
+		return -1;
+	}
+
+	return pread(entry->fd, buf, size, sizeof(struct MetaEntryHeader) + data_offset);
+}
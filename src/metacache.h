@@ -0,0 +1,41 @@
+/*
+ * metacache.h - Userspace video caching filesystem
+ *
+ * Copyright 2008 Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef _METACACHE_H
+#define _METACACHE_H
+
+#include "stdafx.h"
+
+struct MetaCache;
+struct MetaCacheEntry;
+
+struct MetaCache* meta_cache_new(const char* cache_root, guint head_size, guint tail_size);
+void meta_cache_free(struct MetaCache* this);
+void meta_cache_start_evictor(struct MetaCache* this, guint64 high_watermark, guint64 low_watermark);
+gboolean meta_cache_covers(struct MetaCache* this, off_t file_size, size_t size, off_t offset);
+struct MetaCacheEntry* meta_cache_lookup(struct MetaCache* this, const char* relative_path, const struct stat* source_st);
+int meta_cache_fill(struct MetaCache* this, const char* relative_path, int source_fd);
+void meta_cache_entry_free(struct MetaCacheEntry* entry);
+int meta_cache_entry_read(struct MetaCacheEntry* entry, char* buf, size_t size, off_t offset);
+
+#endif
@@ -28,21 +28,30 @@
 struct WorkitemQueue {
 	GAsyncQueue* to_process;
 	GThread* thread;
-	gboolean should_quit;
+	gint should_quit;
 };
 
 struct Workitem {
 	GFunc func;
 	gpointer data;
 	gpointer context;
+	GDestroyNotify destroy;
 };
 
+static void workitem_free(struct Workitem* item)
+{
+	/* NOTE: Only for items that never ran; func owns data otherwise */
+	if (item->destroy && item->data)
+		(item->destroy)(item->data);
+	g_free(item);
+}
+
 static gpointer worker_thread_proc(gpointer data)
 {
 	struct WorkitemQueue* this = data;
 	g_async_queue_ref(this->to_process);
 
-	while(!this->should_quit) {
+	while(!g_atomic_int_get(&this->should_quit)) {
 		GTimeVal two_second_delay;
 		g_get_current_time(&two_second_delay);
 		g_time_val_add(&two_second_delay, 2 * 1000 * 1000);
@@ -91,27 +100,37 @@ void workitem_queue_free(struct WorkitemQueue* queue)
 	if (!queue)
 		return;
 
-	queue->should_quit = TRUE;
+	g_atomic_int_set(&queue->should_quit, 1);
 
-	/* Clear out the action queue */
+	/* Clear out the action queue, then wake the worker up so it notices */
 	struct Workitem* to_free;
 	g_async_queue_lock(queue->to_process);
 	while( (to_free = g_async_queue_try_pop_unlocked(queue->to_process)) ) {
-		g_free(to_free);
+		workitem_free(to_free);
 	}
+	g_async_queue_push_unlocked(queue->to_process, g_new0(struct Workitem, 1));
+	g_async_queue_unlock(queue->to_process);
 
 	g_thread_join(queue->thread);
+
+	/* Anything that snuck in while we were waiting */
+	while( (to_free = g_async_queue_try_pop(queue->to_process)) ) {
+		workitem_free(to_free);
+	}
+
 	g_async_queue_unref(queue->to_process);
 	g_free(queue);
 }
 
-gboolean workitem_queue_insert(struct WorkitemQueue* queue, GFunc func, gpointer data, gpointer context)
+gboolean workitem_queue_insert(struct WorkitemQueue* queue, GFunc func, gpointer data, gpointer context, 
+		GDestroyNotify destroy)
 {
 	if (!queue)
 		return FALSE;
 
 	struct Workitem* obj = g_new(struct Workitem, 1);
 	obj->func = func;  obj->data = data;  obj->context = context;
+	obj->destroy = destroy;
 	g_async_queue_push(queue->to_process, obj);
 	return TRUE;
 }
@@ -31,6 +31,7 @@ struct WorkitemQueue;
 
 struct WorkitemQueue* workitem_queue_new(void);
 void workitem_queue_free(struct WorkitemQueue* queue);
-gboolean workitem_queue_insert(struct WorkitemQueue* queue, GFunc func, gpointer data, gpointer context);
+gboolean workitem_queue_insert(struct WorkitemQueue* queue, GFunc func, gpointer data, gpointer context, 
+		GDestroyNotify destroy);
 
 #endif 
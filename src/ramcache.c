@@ -0,0 +1,257 @@
+/*
+ * ramcache.c - In-memory block cache
+ *
+ * Copyright 2008 Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+#include "stdafx.h"
+#include "ramcache.h"
+
+/* Cover art, playlists, and tag reads are tiny and get read over and
+ * over, so it's silly to go to disk for them every time. We carve one
+ * big arena up into fixed-size slots when we start, and keep recently
+ * read blocks in them, keyed by a file id and block number. Slots are
+ * reused in CLOCK order, so a block that's been read since the hand last
+ * went by gets a second chance.
+ *
+ * A file's id is tied to the size and mtime it had when we handed the id
+ * out; if either changes, the file gets a new id and its old blocks just
+ * age out, so there's never anything to invalidate */
+
+#define RAMCACHE_MAX_IDS 	(64 * 1024)
+
+struct RamKey {
+	guint32 id;
+	guint64 block;
+};
+
+struct RamSlot {
+	struct RamKey key;
+	guint32 len;
+	gboolean used;
+	gboolean referenced;
+};
+
+struct RamFileId {
+	guint32 id;
+	off_t size;
+	time_t mtime;
+};
+
+struct RamCache {
+	guint block_size;
+	guint slot_count;
+	char* arena;
+	struct RamSlot* slots;
+	guint hand;
+
+	/* RamKey => RamSlot; keys live in the slots themselves */
+	GHashTable* index;
+
+	/* Relative path => RamFileId */
+	GHashTable* ids;
+	guint32 next_id;
+
+	GStaticMutex lock;
+};
+
+static guint ram_key_hash(gconstpointer key)
+{
+	const struct RamKey* k = key;
+	return k->id * 2654435761u ^ (guint)k->block ^ (guint)(k->block >> 32);
+}
+
+static gboolean ram_key_equal(gconstpointer a, gconstpointer b)
+{
+	const struct RamKey* ka = a;
+	const struct RamKey* kb = b;
+	return (ka->id == kb->id && ka->block == kb->block);
+}
+
+static char* slot_data(struct RamCache* this, struct RamSlot* slot)
+{
+	return this->arena + (gsize)(slot - this->slots) * this->block_size;
+}
+
+static struct RamSlot* claim_slot(struct RamCache* this)
+{
+	struct RamSlot* slot;
+
+	/* Sweep until we find someone who hasn't been read since last time;
+	 * this ends after at most two trips around */
+	for(;;) {
+		slot = &this->slots[this->hand];
+		this->hand = (this->hand + 1) % this->slot_count;
+
+		if (!slot->used)
+			break;
+		if (!slot->referenced) {
+			g_hash_table_remove(this->index, &slot->key);
+			break;
+		}
+		slot->referenced = FALSE;
+	}
+
+	slot->used = FALSE;
+	slot->referenced = FALSE;
+	return slot;
+}
+
+struct RamCache* ram_cache_new(guint64 budget, guint block_size)
+{
+	struct RamCache* ret;
+	if (!block_size || budget < block_size)
+		return NULL;
+
+	ret = g_new0(struct RamCache, 1);
+	ret->block_size = block_size;
+	ret->slot_count = budget / block_size;
+	ret->arena = g_try_malloc((gsize)ret->slot_count * block_size);
+	if (!ret->arena) {
+		g_free(ret);
+		return NULL;
+	}
+
+	ret->slots = g_new0(struct RamSlot, ret->slot_count);
+	ret->index = g_hash_table_new(ram_key_hash, ram_key_equal);
+	ret->ids = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	ret->next_id = 1;
+	g_static_mutex_init(&ret->lock);
+
+	return ret;
+}
+
+void ram_cache_free(struct RamCache* this)
+{
+	if (!this)
+		return;
+
+	g_hash_table_destroy(this->index);
+	g_hash_table_destroy(this->ids);
+	g_static_mutex_free(&this->lock);
+	g_free(this->slots);
+	g_free(this->arena);
+	g_free(this);
+}
+
+guint32 ram_cache_get_id(struct RamCache* this, const char* relative_path, off_t size, time_t mtime)
+{
+	struct RamFileId* file_id;
+	guint32 ret;
+
+	if (!this)
+		return 0;
+
+	g_static_mutex_lock(&this->lock);
+
+	file_id = g_hash_table_lookup(this->ids, relative_path);
+	if (!file_id || file_id->size != size || file_id->mtime != mtime) {
+		/* Ids are never reused, so forgetting them all is safe */
+		if (!file_id && g_hash_table_size(this->ids) >= RAMCACHE_MAX_IDS)
+			g_hash_table_remove_all(this->ids);
+
+		file_id = g_new0(struct RamFileId, 1);
+		file_id->id = this->next_id++;
+		file_id->size = size;
+		file_id->mtime = mtime;
+		g_hash_table_replace(this->ids, g_strdup(relative_path), file_id);
+	}
+
+	ret = file_id->id;
+	g_static_mutex_unlock(&this->lock);
+
+	return ret;
+}
+
+int ram_cache_read(struct RamCache* this, guint32 id, char* buf, size_t size, off_t offset)
+{
+	struct RamKey key;
+	struct RamSlot* slot;
+	size_t copied = 0;
+	int ret = -1;
+
+	if (!this || !id)
+		return -1;
+
+	key.id = id;
+
+	/* It's all or nothing, since the caller would have to go to disk for
+	 * the rest anyway */
+	g_static_mutex_lock(&this->lock);
+	while(copied < size) {
+		off_t pos = offset + copied;
+		guint in_block = pos % this->block_size;
+
+		key.block = pos / this->block_size;
+		if ( !(slot = g_hash_table_lookup(this->index, &key)) )
+			goto out;
+
+		slot->referenced = TRUE;
+		if (in_block >= slot->len)
+			break;
+
+		size_t count = MIN(size - copied, slot->len - in_block);
+		memcpy(buf + copied, slot_data(this, slot) + in_block, count);
+		copied += count;
+
+		/* A short block is the end of the file */
+		if (slot->len < this->block_size)
+			break;
+	}
+	ret = copied;
+
+out:
+	g_static_mutex_unlock(&this->lock);
+	return ret;
+}
+
+void ram_cache_insert(struct RamCache* this, guint32 id, const char* buf, size_t size, off_t offset, gboolean at_eof)
+{
+	struct RamKey key;
+	struct RamSlot* slot;
+	guint64 block;
+	off_t end = offset + size;
+
+	if (!this || !id)
+		return;
+
+	key.id = id;
+
+	/* We only keep whole blocks, plus the last bit of the file */
+	g_static_mutex_lock(&this->lock);
+	for(block = (offset + this->block_size - 1) / this->block_size; ; block++) {
+		off_t start = (off_t)block * this->block_size;
+		guint len = MIN((off_t)this->block_size, end - start);
+
+		if (start >= end || (len < this->block_size && !at_eof))
+			break;
+
+		key.block = block;
+		if (g_hash_table_lookup(this->index, &key))
+			continue;
+
+		slot = claim_slot(this);
+		slot->key = key;
+		slot->len = len;
+		slot->used = TRUE;
+		memcpy(slot_data(this, slot), buf + (start - offset), len);
+		g_hash_table_insert(this->index, &slot->key, slot);
+	}
+	g_static_mutex_unlock(&this->lock);
+}
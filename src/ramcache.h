@@ -0,0 +1,37 @@
+/*
+ * ramcache.h - Userspace video caching filesystem
+ *
+ * Copyright 2008 Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef _RAMCACHE_H
+#define _RAMCACHE_H
+
+#include "stdafx.h"
+
+struct RamCache;
+
+struct RamCache* ram_cache_new(guint64 budget, guint block_size);
+void ram_cache_free(struct RamCache* this);
+guint32 ram_cache_get_id(struct RamCache* this, const char* relative_path, off_t size, time_t mtime);
+int ram_cache_read(struct RamCache* this, guint32 id, char* buf, size_t size, off_t offset);
+void ram_cache_insert(struct RamCache* this, guint32 id, const char* buf, size_t size, off_t offset, gboolean at_eof);
+
+#endif
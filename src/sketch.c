@@ -0,0 +1,139 @@
+/*
+ * sketch.c - Approximate access frequency counter
+ *
+ * Copyright 2008 Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include "stdafx.h"
+#include "sketch.h"
+
+/* A count-min sketch: a few rows of small counters, each indexed by a
+ * different hash of the key. Bumping a key bumps one counter per row, and
+ * the smallest of those is our guess at how often we've seen it; it can
+ * only ever guess high, when keys collide. Counters top out at 15, and
+ * once we've counted enough, everything gets cut in half so that what
+ * was popular last month doesn't stay popular forever */
+
+#define SKETCH_DEPTH 		4
+#define SKETCH_MAX_COUNT 	15
+#define SKETCH_AGE_FACTOR 	10
+
+struct FreqSketch {
+	guint width_mask;
+	guint8* counters;
+
+	guint additions;
+	guint age_at;
+
+	GStaticMutex lock;
+};
+
+static guint64 hash_key(const char* key)
+{
+	/* 64-bit FNV-1a; we split it in two to make the row hashes */
+	guint64 ret = 14695981039346656037ULL;
+	const unsigned char* p;
+	for(p = (const unsigned char*)key; *p; p++) {
+		ret ^= *p;
+		ret *= 1099511628211ULL;
+	}
+
+	return ret;
+}
+
+static guint counter_index(struct FreqSketch* this, guint64 hash, int row)
+{
+	guint32 h1 = (guint32)hash, h2 = (guint32)(hash >> 32);
+	return row * (this->width_mask + 1) + ((h1 + row * h2) & this->width_mask);
+}
+
+struct FreqSketch* freq_sketch_new(guint width)
+{
+	struct FreqSketch* ret = g_new0(struct FreqSketch, 1);
+
+	/* Round up to a power of two so we can mask instead of divide */
+	guint real_width = 16;
+	while (real_width < width)
+		real_width <<= 1;
+
+	ret->width_mask = real_width - 1;
+	ret->counters = g_new0(guint8, real_width * SKETCH_DEPTH);
+	ret->age_at = real_width * SKETCH_AGE_FACTOR;
+	g_static_mutex_init(&ret->lock);
+	return ret;
+}
+
+void freq_sketch_free(struct FreqSketch* this)
+{
+	if (!this)
+		return;
+
+	g_free(this->counters);
+	g_static_mutex_free(&this->lock);
+	g_free(this);
+}
+
+static void age_counters(struct FreqSketch* this)
+{
+	guint i, count = (this->width_mask + 1) * SKETCH_DEPTH;
+	for(i=0; i < count; i++)
+		this->counters[i] >>= 1;
+	this->additions /= 2;
+}
+
+void freq_sketch_increment(struct FreqSketch* this, const char* key)
+{
+	guint64 hash = hash_key(key);
+	gboolean added = FALSE;
+	int i;
+
+	if (!this)
+		return;
+
+	g_static_mutex_lock(&this->lock);
+	for(i=0; i < SKETCH_DEPTH; i++) {
+		guint8* counter = &this->counters[counter_index(this, hash, i)];
+		if (*counter < SKETCH_MAX_COUNT) {
+			(*counter)++;
+			added = TRUE;
+		}
+	}
+
+	if (added && ++this->additions >= this->age_at)
+		age_counters(this);
+	g_static_mutex_unlock(&this->lock);
+}
+
+guint freq_sketch_estimate(struct FreqSketch* this, const char* key)
+{
+	guint64 hash = hash_key(key);
+	guint ret = SKETCH_MAX_COUNT;
+	int i;
+
+	if (!this)
+		return 0;
+
+	g_static_mutex_lock(&this->lock);
+	for(i=0; i < SKETCH_DEPTH; i++)
+		ret = MIN(ret, this->counters[counter_index(this, hash, i)]);
+	g_static_mutex_unlock(&this->lock);
+
+	return ret;
+}
@@ -0,0 +1,36 @@
+/*
+ * sketch.h - Userspace video caching filesystem
+ *
+ * Copyright 2008 Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef _SKETCH_H
+#define _SKETCH_H
+
+#include "stdafx.h"
+
+struct FreqSketch;
+
+struct FreqSketch* freq_sketch_new(guint width);
+void freq_sketch_free(struct FreqSketch* this);
+void freq_sketch_increment(struct FreqSketch* this, const char* key);
+guint freq_sketch_estimate(struct FreqSketch* this, const char* key);
+
+#endif
@@ -0,0 +1,179 @@
+/*
+ * statpool.c - Concurrent stat() for directory listings
+ *
+ * Copyright 2008 Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include "stdafx.h"
+#include "statpool.h"
+
+#ifdef HAVE_STATX
+#include <sys/sysmacros.h>
+#endif
+
+/* Listing a directory on a network share costs one round trip per entry
+ * if we stat() them one at a time. Instead, we throw every entry at a
+ * fixed-size pool of threads and hand results back in whatever order they
+ * finish, so a cold listing costs about (entries / threads) round trips.
+ * Entries are stat'ed relative to the directory's fd, so the server only
+ * has to resolve the last path component */
+
+struct StatPool {
+	GThreadPool* pool;
+};
+
+struct StatBatch {
+	struct StatPool* pool;
+	int dir_fd;
+	guint outstanding;
+	GAsyncQueue* results;
+};
+
+struct StatJob {
+	struct StatBatch* batch;
+	char* name;
+	struct stat st;
+	int err;
+};
+
+static int stat_relative(int dir_fd, const char* name, struct stat* st)
+{
+#ifdef HAVE_STATX
+	struct statx stx;
+	if (statx(dir_fd, name, AT_STATX_SYNC_AS_STAT, STATX_BASIC_STATS, &stx) != 0)
+		return -errno;
+
+	memset(st, 0, sizeof(struct stat));
+	st->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+	st->st_ino = stx.stx_ino;
+	st->st_mode = stx.stx_mode;
+	st->st_nlink = stx.stx_nlink;
+	st->st_uid = stx.stx_uid;
+	st->st_gid = stx.stx_gid;
+	st->st_rdev = makedev(stx.stx_rdev_major, stx.stx_rdev_minor);
+	st->st_size = stx.stx_size;
+	st->st_blksize = stx.stx_blksize;
+	st->st_blocks = stx.stx_blocks;
+	st->st_atime = stx.stx_atime.tv_sec;
+	st->st_mtime = stx.stx_mtime.tv_sec;
+	st->st_ctime = stx.stx_ctime.tv_sec;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+	/* Everyone downstream compares these against a real stat() */
+	st->st_atim.tv_nsec = stx.stx_atime.tv_nsec;
+	st->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+	st->st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+#endif
+	return 0;
+#else
+	return (fstatat(dir_fd, name, st, 0) == 0 ? 0 : -errno);
+#endif
+}
+
+static void stat_job_run(gpointer data, gpointer dontcare)
+{
+	struct StatJob* job = data;
+	job->err = stat_relative(job->batch->dir_fd, job->name, &job->st);
+	g_async_queue_push(job->batch->results, job);
+}
+
+struct StatPool* stat_pool_new(guint max_threads)
+{
+	struct StatPool* ret = g_new0(struct StatPool, 1);
+	if (!ret || !max_threads)
+		goto failed;
+
+	if (!(ret->pool = g_thread_pool_new(stat_job_run, NULL, max_threads, FALSE, NULL)))
+		goto failed;
+
+	return ret;
+
+failed:
+	g_free(ret);
+	return NULL;
+}
+
+void stat_pool_free(struct StatPool* this)
+{
+	if (!this)
+		return;
+
+	g_thread_pool_free(this->pool, TRUE, TRUE);
+	g_free(this);
+}
+
+struct StatBatch* stat_batch_new(struct StatPool* pool, int dir_fd)
+{
+	struct StatBatch* ret = g_new0(struct StatBatch, 1);
+	ret->pool = pool;
+	ret->dir_fd = dir_fd;
+	ret->results = g_async_queue_new();
+	return ret;
+}
+
+void stat_batch_add(struct StatBatch* batch, const char* name)
+{
+	struct StatJob* job = g_new0(struct StatJob, 1);
+	job->batch = batch;
+	job->name = g_strdup(name);
+
+	batch->outstanding++;
+
+	/* No pool? Do it inline */
+	if (!batch->pool) {
+		stat_job_run(job, NULL);
+		return;
+	}
+	g_thread_pool_push(batch->pool->pool, job, NULL);
+}
+
+gboolean stat_batch_next(struct StatBatch* batch, char** name, struct stat* st, int* err)
+{
+	/* NOTE: The caller owns the returned name */
+	if (batch->outstanding == 0)
+		return FALSE;
+
+	struct StatJob* job = g_async_queue_pop(batch->results);
+	batch->outstanding--;
+
+	*name = job->name;
+	*err = job->err;
+	if (job->err == 0)
+		*st = job->st;
+
+	g_free(job);
+	return TRUE;
+}
+
+void stat_batch_free(struct StatBatch* batch)
+{
+	char* name;
+	struct stat st;
+	int err;
+
+	if (!batch)
+		return;
+
+	/* We can't go away while a worker could still write to us */
+	while (stat_batch_next(batch, &name, &st, &err))
+		g_free(name);
+
+	g_async_queue_unref(batch->results);
+	g_free(batch);
+}
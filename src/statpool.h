@@ -0,0 +1,40 @@
+/*
+ * statpool.h - Userspace video caching filesystem
+ *
+ * Copyright 2008 Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef _STATPOOL_H
+#define _STATPOOL_H
+
+#include "stdafx.h"
+
+struct StatPool;
+struct StatBatch;
+
+struct StatPool* stat_pool_new(guint max_threads);
+void stat_pool_free(struct StatPool* this);
+
+struct StatBatch* stat_batch_new(struct StatPool* pool, int dir_fd);
+void stat_batch_add(struct StatBatch* batch, const char* name);
+gboolean stat_batch_next(struct StatBatch* batch, char** name, struct stat* st, int* err);
+void stat_batch_free(struct StatBatch* batch);
+
+#endif
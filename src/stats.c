@@ -39,6 +39,15 @@
 #include "stats.h"
 #include "config.h"
 
+/* The low-level FUSE API doesn't set up a fuse_context, so the frontend
+ * tells us when there's no pid to be had */
+static gint use_fuse_context = TRUE;
+
+void stats_disable_fuse_context(void)
+{
+	g_atomic_int_set(&use_fuse_context, FALSE);
+}
+
 GIOChannel* stats_open_logging(void)
 {
 	char* path = getenv("VCACHEFS_STATS_FILE");
@@ -70,15 +79,16 @@ int stats_write_record(GIOChannel* channel, const char* operation, off_t offset,
 
 	const char* safe_info = (info ? info : "");
 
-	struct fuse_context* ctx = fuse_get_context(); 
+	struct fuse_context* ctx = (g_atomic_int_get(&use_fuse_context) ? fuse_get_context() : NULL); 
+	unsigned int pid = (ctx ? ctx->pid : 0);
 
 	gchar* buf;
 	if (sizeof(off_t) == 8) {
 	 	buf = g_strdup_printf("%llu,\"%s\",%llu,%lu,\"%s\",%u\n", 
-			get_time_code(), operation, (unsigned long long)offset, size, safe_info, ctx->pid);
+			get_time_code(), operation, (unsigned long long)offset, size, safe_info, pid);
 	} else {
 	 	buf = g_strdup_printf("%llu,\"%s\",%lu,%lu,\"%s\",%u\n", 
-			get_time_code(), operation, (unsigned long)offset, size, safe_info, ctx->pid);
+			get_time_code(), operation, (unsigned long)offset, size, safe_info, pid);
 	}
 
 	gsize dontcare;
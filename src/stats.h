@@ -28,5 +28,6 @@ GIOChannel* stats_open_logging(void);
 void stats_close_logging(GIOChannel* channel);
 int stats_write_record(GIOChannel* channel, const char* operation, off_t offset, size_t size, const char* info);
 long long unsigned int get_time_code(void);
+void stats_disable_fuse_context(void);
 
 #endif 
@@ -43,6 +43,18 @@
 #include "stats.h"
 #include "queue.h"
 #include "cachemgr.h"
+#include "blockcache.h"
+#include "metacache.h"
+#include "attrcache.h"
+#include "dircache.h"
+#include "statpool.h"
+#include "copyqueue.h"
+#include "fill.h"
+#include "handletable.h"
+#include "ramcache.h"
+
+/* How much a resumable fill copies between saving its progress */
+#define FILL_CHECKPOINT_SIZE 	(64 * 1024 * 1024)
 
 /* Globals */
 GIOChannel* stats_file = NULL;
@@ -63,6 +75,8 @@ static struct vcachefs_fdentry* fdentry_new(void)
 {
 	struct vcachefs_fdentry* ret = g_new0(struct vcachefs_fdentry, 1);
 	ret->refcnt = 1;
+	ret->source_fd = ret->filecache_fd = -1;
+	g_static_mutex_init(&ret->readahead.lock);
 	return ret;
 }
 
@@ -75,37 +89,28 @@ static struct vcachefs_fdentry* fdentry_ref(struct vcachefs_fdentry* obj)
 static void fdentry_unref(struct vcachefs_fdentry* obj)
 {
 	if(g_atomic_int_dec_and_test(&obj->refcnt)) {
-		if(obj->source_fd > 0)
+		if(obj->source_fd >= 0)
 			close(obj->source_fd);
-		if(obj->filecache_fd > 0)
+		if(obj->filecache_fd >= 0)
 			close(obj->filecache_fd);
+		block_cache_close(obj->block_file);
+		meta_cache_entry_free(obj->meta_entry);
+		fill_progress_unref(obj->fill_progress);
+		g_static_mutex_free(&obj->readahead.lock);
 		g_free(obj->relative_path);
 		g_free(obj);
 	}
 }
 
-static struct vcachefs_fdentry* fdentry_from_fd(uint fd)
+static struct vcachefs_fdentry* fdentry_from_fi(struct fuse_file_info* fi)
 {
-	struct vcachefs_fdentry* ret = NULL;
-	struct vcachefs_mount* mount_obj = get_current_mountinfo();
-
-	g_static_rw_lock_reader_lock(&mount_obj->fd_table_rwlock);
-	ret = g_hash_table_lookup(mount_obj->fd_table, &fd);
-	g_static_rw_lock_reader_unlock(&mount_obj->fd_table_rwlock);
-
-	return (ret ? fdentry_ref(ret) : NULL);
+	/* NOTE: The handle table holds a ref until release, and FUSE won't
+	 * hand us this fh after that, so there's nothing to look up or lock */
+	return (struct vcachefs_fdentry*)(gsize)fi->fh;
 }
 
-static char* build_cache_path(const char* source_path)
+static char* build_cache_path(const char* cache_root, const char* source_path)
 {
-	const char* env = getenv("VCACHEFS_CACHEPATH");
-	char* cache_root;
-	if (env) {
-		cache_root = g_strdup(env);
-	} else {
-		cache_root = g_build_filename(getenv("HOME"), ".vcachefs", NULL);
-	}
-
 	// Calculate the MD5 of the source path
 	gchar* sum = NULL;
 	gchar* ret = NULL;
@@ -113,10 +118,87 @@ static char* build_cache_path(const char* source_path)
 	ret = g_build_filename(cache_root, sum, NULL);
 	g_free(sum);
 
-	g_free(cache_root);
 	return ret;
 }
 
+static guint64 parse_size(const char* str, guint64 default_value)
+{
+	/* Sizes can be given as plain bytes, or with a K/M/G/T suffix */
+	char* suffix = NULL;
+	if (!str || !*str)
+		return default_value;
+
+	guint64 ret = g_ascii_strtoull(str, &suffix, 10);
+	switch (suffix ? *suffix : '\0') {
+	case 'T': case 't':
+		ret *= 1024;
+		/* Fall through */
+	case 'G': case 'g':
+		ret *= 1024;
+		/* Fall through */
+	case 'M': case 'm':
+		ret *= 1024;
+		/* Fall through */
+	case 'K': case 'k':
+		ret *= 1024;
+	}
+	return ret;
+}
+
+static guint64 get_env_size(const char* name, guint64 default_value)
+{
+	return parse_size(getenv(name), default_value);
+}
+
+static void get_watermarks(guint64 max_size, guint64* high, guint64* low)
+{
+	/* Eviction kicks in once we're over the high mark, and clears out
+	 * down to the low one; both are percentages of the cache's size */
+	guint64 high_pct = MIN(get_env_size("VCACHEFS_EVICT_HIGH", 95), 100);
+	guint64 low_pct = MIN(get_env_size("VCACHEFS_EVICT_LOW", 85), high_pct);
+
+	*high = max_size / 100 * high_pct;
+	*low = max_size / 100 * low_pct;
+}
+
+static gboolean same_mtime(const struct stat* source_st, const struct stat* cache_st)
+{
+	if (source_st->st_mtime != cache_st->st_mtime)
+		return FALSE;
+
+#ifdef HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+	/* If the cache's filesystem can't keep nanoseconds, seconds will
+	 * have to do */
+	if (cache_st->st_mtim.tv_nsec != 0 && source_st->st_mtim.tv_nsec != cache_st->st_mtim.tv_nsec)
+		return FALSE;
+#endif
+	return TRUE;
+}
+
+static int stamp_mtime(int fd, const struct stat* source_st)
+{
+	/* Cached copies carry the mtime of the source they came from, so we
+	 * can tell later whether it's still the same file */
+#if defined(HAVE_FUTIMENS)
+	struct timespec times[2];
+	times[0].tv_sec = 0;  times[0].tv_nsec = UTIME_OMIT;
+	times[1].tv_sec = source_st->st_mtime;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+	times[1].tv_nsec = source_st->st_mtim.tv_nsec;
+#else
+	times[1].tv_nsec = 0;
+#endif
+	return futimens(fd, times);
+#elif defined(HAVE_FUTIMES)
+	struct timeval times[2];
+	times[0].tv_sec = source_st->st_atime;  times[0].tv_usec = 0;
+	times[1].tv_sec = source_st->st_mtime;  times[1].tv_usec = 0;
+	return futimes(fd, times);
+#else
+	return 0;
+#endif
+}
+
 
 /*
  * File-based cache functions
@@ -131,54 +213,208 @@ static int try_open_from_cache(const char* cache_root, const char* relative_path
 	return ret;
 }
 
-static int copy_file_and_return_destfd(const char* source_root, const char* dest_root, const char* relative_path, gint* quitflag_atomic)
+static struct vcachefs_tier* open_from_cache_tiers(struct vcachefs_mount* mount_obj, const char* relative_path, 
+		int flags, int* fd_out)
 {
+	/* Fastest first; whoever has it is whoever we'll use */
+	guint i;
+	for(i=0; i < mount_obj->tiers->len; i++) {
+		struct vcachefs_tier* tier = g_ptr_array_index(mount_obj->tiers, i);
+		if ( (*fd_out = try_open_from_cache(tier->cache_path, relative_path, flags)) >= 0)
+			return tier;
+	}
+
+	return NULL;
+}
+
+/* Stupid struct to pass a tuple through to this fn */
+struct fill_checkpoint {
+	struct FillProgress* landed;
+	int dest_fd;
+	const char* record_path;
+	const char* relative_path;
+	struct stat source_st;
+
+	/* Streams report in all at once, so these are protected by lock */
+	off_t unsaved;
+	gboolean saving;
+	GStaticMutex lock;
+};
+
+static void checkpoint_fill(struct fill_checkpoint* cp)
+{
+	struct FillProgress* snapshot;
+	off_t saving;
+	gboolean saved;
+
+	if (!cp->record_path)
+		return;
+
+	/* One stream does the saving, and everyone else keeps copying */
+	g_static_mutex_lock(&cp->lock);
+	if (cp->saving || !cp->unsaved) {
+		g_static_mutex_unlock(&cp->lock);
+		return;
+	}
+	cp->saving = TRUE;
+	saving = cp->unsaved;
+	cp->unsaved = 0;
+	snapshot = fill_progress_copy(cp->landed);
+	g_static_mutex_unlock(&cp->lock);
+
+	/* Everything in the snapshot has already been written, so once this
+	 * fsync is done, the record can say it's on disk */
+	saved = (fsync(cp->dest_fd) == 0 && 
+		 fill_record_save(cp->record_path, cp->relative_path, &cp->source_st, snapshot) == 0);
+	fill_progress_unref(snapshot);
+
+	g_static_mutex_lock(&cp->lock);
+	cp->saving = FALSE;
+	if (!saved)
+		cp->unsaved += saving;
+	g_static_mutex_unlock(&cp->lock);
+}
+
+static gboolean fill_checkpoint_update(off_t offset, off_t length, gpointer context)
+{
+	struct fill_checkpoint* cp = context;
+	gboolean due;
+
+	fill_progress_add(cp->landed, offset, length);
+
+	g_static_mutex_lock(&cp->lock);
+	cp->unsaved += length;
+	due = (cp->unsaved >= FILL_CHECKPOINT_SIZE && !cp->saving);
+	g_static_mutex_unlock(&cp->lock);
+
+	if (due)
+		checkpoint_fill(cp);
+	return TRUE;
+}
+
+static gboolean can_resume_fill(const char* record_path, const char* relative_path, 
+		const struct stat* source_st, const char* partial_path)
+{
+	gchar* record_relative_path = NULL;
+	struct stat record_st;
+	gboolean ret;
+	struct stat st;
+
+	if (!fill_record_load(record_path, &record_relative_path, &record_st, NULL))
+		return FALSE;
+
+	/* If the source has changed since, what we have is junk */
+	ret = (strcmp(record_relative_path, relative_path) == 0 && 
+	       record_st.st_size == source_st->st_size && same_mtime(source_st, &record_st) && 
+	       stat(partial_path, &st) == 0);
+
+	g_free(record_relative_path);
+	return ret;
+}
+
+static int copy_file_and_return_destfd(const char* source_root, const char* dest_root, const char* relative_path, 
+		const char* record_path, guint streams, gint* quitflag_atomic, struct FillProgress* progress)
+{
+	/* NOTE: If record_path is set, an interrupted copy leaves its staging
+	 * file and a record of what it got, so the next one can resume */
 	gchar* src_path = g_build_filename(source_root, relative_path, NULL);
 	gchar* dest_path = g_build_filename(dest_root, relative_path, NULL);
-	int src_fd = 0, dest_fd = 0;
+	gchar* partial_path = g_strdup_printf("%s.partial", dest_path);
+	int dest_fd = -1;
+	gboolean resuming = FALSE;
+	struct fill_checkpoint cp;
+
+	memset(&cp, 0, sizeof(cp));
+	g_static_mutex_init(&cp.lock);
+
+	/* Someone already copied this one */
+	if (access(dest_path, F_OK) == 0) {
+		if (record_path)
+			unlink(record_path);
+		goto out;
+	}
+
+	if (stat(src_path, &cp.source_st) < 0) {
+		/* It's gone for good, so there's nothing left to resume */
+		if (errno == ENOENT && record_path) {
+			unlink(record_path);
+			unlink(partial_path);
+		}
+		goto out;
+	}
+
+	/* Readers can use anything that lands as soon as it does */
+	cp.landed = (progress ? fill_progress_ref(progress) : fill_progress_new());
+	if (record_path && can_resume_fill(record_path, relative_path, &cp.source_st, partial_path)) {
+		gchar* tmp = NULL;
+		struct stat record_st;
+		resuming = fill_record_load(record_path, &tmp, &record_st, cp.landed);
+		g_free(tmp);
+	}
 
-	g_debug("Copying '%s' to '%s'", src_path, dest_path);
-	src_fd = open(src_path, O_RDONLY);
-	dest_fd = open(dest_path, O_RDWR | O_CREAT | O_EXCL, S_IRWXU | S_IRGRP | S_IROTH);
-	if (src_fd <= 0 || dest_fd <= 0)
+	/* We copy into a scratch file and move it into place when we're done,
+	 * so nobody ever opens a half-copied file thinking it's the real thing.
+	 * A fresh copy gets a fresh file, since readers of an earlier fill may
+	 * still be reading the old one through its FillProgress */
+	g_debug("%s '%s' to '%s'", (resuming ? "Resuming" : "Copying"), src_path, partial_path);
+	if (!resuming)
+		unlink(partial_path);
+	dest_fd = open(partial_path, O_RDWR | O_CREAT | (resuming ? 0 : O_TRUNC), S_IRWXU | S_IRGRP | S_IROTH);
+	if (dest_fd < 0)
 		goto out;
 
-	stats_write_record(stats_file, "copyfile", 0, 0, relative_path);
+	cp.dest_fd = dest_fd;
+	cp.record_path = record_path;  cp.relative_path = relative_path;
+
+	if (resuming) {
+		stats_write_record(stats_file, "resumefile", 0, 0, relative_path);
+	} else {
+		stats_write_record(stats_file, "copyfile", 0, 0, relative_path);
+		if (record_path)
+			fill_record_save(record_path, relative_path, &cp.source_st, NULL);
+	}
 
 	/* We've got files, let's go to town */
-	char buf[4096];
-	int has_read, has_written;
-	do {
-		has_read = read(src_fd, buf, 4096);
-
-		if (g_atomic_int_get(quitflag_atomic)) {
-			has_read = -1;
-			has_written = -1;
-			break;
+	if (progress)
+		fill_progress_set_fd(progress, dest_fd);
+	if (fill_copy_missing(src_path, dest_fd, cp.source_st.st_size, cp.landed, streams, 
+				quitflag_atomic, fill_checkpoint_update, &cp) < 0) {
+		/* Hang on to whatever we got if we can pick it up later */
+		if (record_path) {
+			checkpoint_fill(&cp);
+		} else {
+			unlink(partial_path);
 		}
+		close(dest_fd);
+		dest_fd = -1;
+		goto out;
+	}
 
-		has_written = 0;
-		if (has_read > 0)
-			has_written = write(dest_fd, buf, has_read);
-	} while (has_read > 0 && has_written == has_read );
-
-	/* Something has gone wrong */
-	if (has_written != has_read || has_read < 0) {
-		unlink(dest_path);
+	/* Make sure it's all on disk before it turns into the real thing */
+	if (stamp_mtime(dest_fd, &cp.source_st) < 0 || 
+	    (record_path && fsync(dest_fd) < 0) || rename(partial_path, dest_path) < 0) {
+		/* Something has gone wrong */
+		unlink(partial_path);
+		if (record_path)
+			unlink(record_path);
 		close(dest_fd);
 		dest_fd = -1;
 		goto out;
 	}
 
+	if (record_path)
+		unlink(record_path);
+
 	g_debug("Copy succeeded");
 	lseek(dest_fd, 0, SEEK_SET);
 
 out:
 	g_debug("Exiting, dest_fd = %d", dest_fd);
-	if (src_fd > 0)
-		close(src_fd);
+	fill_progress_unref(cp.landed);
+	g_static_mutex_free(&cp.lock);
 	g_free(src_path);
 	g_free(dest_path);
+	g_free(partial_path);
 
 	return dest_fd;
 }
@@ -189,138 +425,514 @@ struct cache_entry {
 	char* relative_path;
 };
 
-static void add_cache_fd_to_item(gpointer key, gpointer value, gpointer cache_entry)
+static void add_cache_fd_to_item(gpointer value, gpointer cache_entry)
 {
-	/* NOTE: Since we've grabbed the fd table lock before this function, we don't need
-	 * to grab a reference to the fd entry */
+	/* NOTE: Since the handle table is locked while we're in here, we don't
+	 * need to grab a reference to the fd entry */
 	struct vcachefs_fdentry* fde = value;
 	struct cache_entry* ce = cache_entry;
-	if (strcmp(fde->relative_path, ce->relative_path))
-		return;
 
+	/* Readers may be in the middle of using the source fd, so we leave it
+	 * alone and just publish the cache fd next to it */
 	int fd = dup(ce->fd);
-	lseek(fd, 0, SEEK_SET);
+	if (fd < 0)
+		return;
 
 	/* Maybe some thread beat us to it? */
-	if (fde->source_fd > 0) {
-		int tmp = fde->source_fd;
-		fde->source_fd = 0;
-		close(tmp);
-	}
+	if (!g_atomic_int_compare_and_exchange(&fde->filecache_fd, -1, fd))
+		close(fd);
+}
 
-	fde->source_offset = fd;
-	fde->source_fd = fd;
+static int create_cache_parent(const char* cache_root, const char* relative_path)
+{
+	/* Create the parent directory if we have to */
+	struct stat st;
+	char* dirname = g_path_get_dirname(relative_path);
+	char* parent_path = g_build_filename(cache_root, dirname, NULL);
+	int err = lstat(parent_path, &st);
+	if (err == -1 && errno == ENOENT) {
+		g_debug("Creating '%s'", parent_path);
+		err = g_mkdir_with_parents(parent_path, 5+7*8+7*8*8);
+	} 
+
+	g_free(dirname);
+	g_free(parent_path);
+	return err;
 }
 
-static gpointer file_cache_copy_thread(gpointer data)
+static char* fill_record_path(struct vcachefs_mount* mount_obj, const char* relative_path)
 {
-	struct vcachefs_mount* mount_obj = data;
+	gchar* sum = g_compute_checksum_for_string(G_CHECKSUM_MD5, relative_path, -1);
+	gchar* ret = g_build_filename(mount_obj->fill_record_root, sum, NULL);
+	g_free(sum);
+	return ret;
+}
 
-	g_debug("Starting cache copy thread...");
-	while(g_atomic_int_get(&mount_obj->quitflag_atomic) == 0) {
-		int err, destfd;
-		struct stat st;
-		struct cache_entry ce;
-		GTimeVal five_secs_from_now;
-		char* relative_path;
+static void resume_pending_fills(struct vcachefs_mount* mount_obj)
+{
+	/* Anything that didn't finish last time gets picked back up */
+	GDir* dir = g_dir_open(mount_obj->fill_record_root, 0, NULL);
+	const gchar* entry;
+	if (!dir)
+		return;
 
-		g_get_current_time(&five_secs_from_now);
-		g_time_val_add(&five_secs_from_now, 5 * 1000 * 1000);
-		relative_path = g_async_queue_timed_pop(mount_obj->file_copy_queue, &five_secs_from_now);
+	while ( (entry = g_dir_read_name(dir)) ) {
+		gchar* record_path = g_build_filename(mount_obj->fill_record_root, entry, NULL);
+		gchar* relative_path = NULL;
+		struct stat record_st;
 
-		/* We didn't have anything to do - let's clean up the cache */
-		if (!relative_path) {
-			cache_manager_reclaim_space(mount_obj->cache_manager, mount_obj->max_cache_size);
-			continue;
+		if (g_str_has_suffix(entry, ".tmp") || 
+		    !fill_record_load(record_path, &relative_path, &record_st, NULL)) {
+			unlink(record_path);
+		} else {
+			g_debug("Resuming fill of '%s'", relative_path);
+			copy_queue_push(mount_obj->copy_queue, relative_path);
 		}
 
-		/* Create the parent directory if we have to */
-		char* dirname = g_path_get_dirname(relative_path);
-		char* parent_path = g_build_filename(mount_obj->cache_path, dirname, NULL);
-		g_debug("Starting copy, picked up '%s'", relative_path);
-		err = lstat(parent_path, &st);
-		if (err == -1 && errno == ENOENT) {
-			g_debug("Creating '%s'", parent_path);
-			if (g_mkdir_with_parents(parent_path, 5+7*8+7*8*8) != 0)
-				goto done;
-		} 
-		if(err < 0) 	/* Couldn't create dir */
-			goto done;
-		
-		destfd = copy_file_and_return_destfd(mount_obj->source_path, mount_obj->cache_path, 
-				relative_path, &mount_obj->quitflag_atomic);
-
-		if (destfd < 0)
-			goto done;
-
-		ce.fd = destfd; 	ce.relative_path = relative_path;
-
-		/* Grab the file table lock, and set the source file handle for every file */
-		g_static_rw_lock_writer_lock(&mount_obj->fd_table_rwlock);
-		g_hash_table_foreach(mount_obj->fd_table, add_cache_fd_to_item, &ce);
-		g_static_rw_lock_writer_unlock(&mount_obj->fd_table_rwlock);
-
-		/* Notify the cache manager */
-		char* dest_path = g_build_filename(mount_obj->cache_path, relative_path, NULL);
-		cache_manager_notify_added(mount_obj->cache_manager, dest_path);
-		g_free(dest_path);
-
-		/* Let go of our original fd */
-		close(destfd);
-
-done:
-		g_free(dirname);
-		g_free(parent_path);
 		g_free(relative_path);
+		g_free(record_path);
 	}
-	g_debug("Ending cache copy thread...");
+	g_dir_close(dir);
+}
 
-	return NULL;
+static void file_cache_copy(const char* relative_path, gpointer context)
+{
+	struct vcachefs_mount* mount_obj = context;
+	int destfd;
+	struct cache_entry ce;
+
+	if (g_atomic_int_get(&mount_obj->quitflag_atomic))
+		return;
+
+	if (create_cache_parent(mount_obj->cache_path, relative_path) < 0)
+		return;
+	
+	/* Let readers know this copy is underway */
+	struct FillProgress* progress = fill_progress_new();
+	g_static_mutex_lock(&mount_obj->fills_lock);
+	g_hash_table_replace(mount_obj->fills_in_flight, g_strdup(relative_path), fill_progress_ref(progress));
+	g_static_mutex_unlock(&mount_obj->fills_lock);
+
+	char* record_path = fill_record_path(mount_obj, relative_path);
+	destfd = copy_file_and_return_destfd(mount_obj->source_path, mount_obj->cache_path, 
+			relative_path, record_path, mount_obj->fill_streams, &mount_obj->quitflag_atomic, progress);
+	g_free(record_path);
+
+	if (destfd < 0)
+		goto unpublish;
+
+	ce.fd = destfd; 	ce.relative_path = (char*)relative_path;
+
+	/* Set the cache file handle for everyone who has this file open */
+	handle_table_foreach_path(mount_obj->handles, relative_path, add_cache_fd_to_item, &ce);
+
+	/* Notify the cache manager */
+	char* dest_path = g_build_filename(mount_obj->cache_path, relative_path, NULL);
+	cache_manager_notify_added(mount_obj->cache_manager, dest_path);
+	g_free(dest_path);
+
+	/* Let go of our original fd */
+	close(destfd);
+
+unpublish:
+	/* Handles that already found the progress hang on to it, everyone
+	 * else can use the cached file now */
+	g_static_mutex_lock(&mount_obj->fills_lock);
+	g_hash_table_remove(mount_obj->fills_in_flight, relative_path);
+	g_static_mutex_unlock(&mount_obj->fills_lock);
+	fill_progress_unref(progress);
 }
 
-gboolean can_delete_cached_file(const char* path, gpointer context)
+static struct FillProgress* fill_in_flight_for(struct vcachefs_mount* mount_obj, struct vcachefs_fdentry* fde)
 {
-	/* Blowing away files who we have an open handle to is probably bad */
+	struct FillProgress* ret = g_atomic_pointer_get((gpointer*)&fde->fill_progress);
+	if (ret)
+		return ret;
+
+	g_static_mutex_lock(&mount_obj->fills_lock);
+	if ( (ret = g_hash_table_lookup(mount_obj->fills_in_flight, fde->relative_path)) )
+		fill_progress_ref(ret);
+	g_static_mutex_unlock(&mount_obj->fills_lock);
+
+	/* Hang on to it, so we only have to go looking once */
+	if (ret && !g_atomic_pointer_compare_and_exchange((gpointer*)&fde->fill_progress, NULL, ret)) {
+		fill_progress_unref(ret);
+		ret = g_atomic_pointer_get((gpointer*)&fde->fill_progress);
+	}
+
+	return ret;
+}
+
+/* Stupid struct to pass a tuple through to this fn */
+struct readahead_job {
+	struct vcachefs_fdentry* fde;
+	off_t offset;
+	size_t size;
+};
+
+static void readahead_thread(gpointer data, gpointer context)
+{
+	struct readahead_job* job = data;
 	struct vcachefs_mount* mount_obj = context;
+
+	/* Don't bother if we're going down, or if the file's been closed and
+	 * we're the only ones left holding it */
+	if (g_atomic_int_get(&mount_obj->quitflag_atomic) == 0 && g_atomic_int_get(&job->fde->refcnt) > 1)
+		block_cache_prefetch(job->fde->block_file, job->fde->source_fd, job->offset, job->size);
+
+	fdentry_unref(job->fde);
+	g_free(job);
+}
+
+static void update_readahead(struct vcachefs_mount* mount_obj, struct vcachefs_fdentry* fde, size_t size, off_t offset)
+{
+	struct vcachefs_readahead* ra = &fde->readahead;
+	off_t start = 0, end = 0;
+
+	if (!mount_obj->readahead_pool || !fde->block_file)
+		return;
+
+	g_static_mutex_lock(&ra->lock);
+
+	/* FUSE can hand us reads a little out of order, so anything that
+	 * starts right around where the last one ended counts */
+	if (offset >= ra->next_offset - (off_t)size && offset <= ra->next_offset + (off_t)size) {
+		ra->sequential_count++;
+	} else {
+		/* Someone's seeking around - shrink the window, and stop reading
+		 * ahead until it looks like a stream again */
+		ra->sequential_count = 0;
+		ra->window /= 2;
+		ra->issued_end = 0;
+	}
+	ra->next_offset = offset + size;
+
+	/* Grow the window every time the stream keeps going, and only ask
+	 * for what we haven't already asked for */
+	if (ra->sequential_count >= 2) {
+		ra->window = (ra->window ? MIN(ra->window * 2, mount_obj->readahead_max) : mount_obj->readahead_min);
+		start = MAX(ra->issued_end, ra->next_offset);
+		end = MIN(ra->next_offset + (off_t)ra->window, fde->file_size);
+		if (end > start)
+			ra->issued_end = end;
+	}
+
+	g_static_mutex_unlock(&ra->lock);
+
+	if (end <= start)
+		return;
+
+	struct readahead_job* job = g_new0(struct readahead_job, 1);
+	job->fde = fdentry_ref(fde);
+	job->offset = start;
+	job->size = end - start;
+	g_thread_pool_push(mount_obj->readahead_pool, job, NULL);
+}
+
+static void meta_cache_fill_workitem(gpointer data, gpointer context)
+{
+	struct vcachefs_mount* mount_obj = context;
+	char* relative_path = data;
+
+	if (g_atomic_int_get(&mount_obj->quitflag_atomic) == 0) {
+		gchar* src_path = g_build_filename(mount_obj->source_path, relative_path, NULL);
+		int src_fd = open(src_path, O_RDONLY);
+		if (src_fd >= 0) {
+			meta_cache_fill(mount_obj->meta_cache, relative_path, src_fd);
+			close(src_fd);
+		}
+		g_free(src_path);
+	}
+
+	g_free(relative_path);
+}
+
+/* 
+ * Kernel page cache
+ */
+
+/* When VCACHEFS_KERNEL_CACHE is set, we let the kernel keep the pages of
+ * a file across opens, as long as the file looks the same as it did the
+ * last time we opened it. If it doesn't, or if we've since thrown our
+ * copy away, the open goes out without keep_cache, which makes the kernel
+ * drop what it had; frontends that can reach the kernel directly also
+ * get told right away through mount->invalidate */
+
+#define KERNEL_CACHE_MAX_ENTRIES 	(64 * 1024)
+
+struct kernel_cache_entry {
+	off_t size;
+	time_t mtime;
+};
+
+static void kernel_cache_forget(struct vcachefs_mount* mount_obj, const char* path)
+{
+	gboolean removed;
+	if (!mount_obj->kernel_cache)
+		return;
+
+	g_static_mutex_lock(&mount_obj->kernel_cache_lock);
+	removed = g_hash_table_remove(mount_obj->kernel_cached, path);
+	g_static_mutex_unlock(&mount_obj->kernel_cache_lock);
+
+	if (removed && mount_obj->invalidate)
+		mount_obj->invalidate(path, mount_obj->invalidate_context);
+}
+
+gboolean vcachefs_mount_keep_cache(struct vcachefs_mount* mount_obj, struct vcachefs_fdentry* fde)
+{
+	struct kernel_cache_entry* entry;
 	gboolean ret;
 
-	g_static_rw_lock_reader_lock(&mount_obj->fd_table_rwlock);
-	/* FIXME: Relative path? */
-	ret = (g_hash_table_lookup(mount_obj->fd_table_byname, path) != NULL);
-	g_static_rw_lock_reader_unlock(&mount_obj->fd_table_rwlock);
+	if (!mount_obj->kernel_cache || mount_obj->pass_through || !fde)
+		return FALSE;
+
+	g_static_mutex_lock(&mount_obj->kernel_cache_lock);
+
+	entry = g_hash_table_lookup(mount_obj->kernel_cached, fde->relative_path);
+	ret = (entry && entry->size == fde->file_size && entry->mtime == fde->mtime);
+
+	if (!ret) {
+		/* Forgetting a file only costs us a re-read, so if we've got
+		 * too many, just start over */
+		if (g_hash_table_size(mount_obj->kernel_cached) >= KERNEL_CACHE_MAX_ENTRIES)
+			g_hash_table_remove_all(mount_obj->kernel_cached);
 
+		entry = g_new0(struct kernel_cache_entry, 1);
+		entry->size = fde->file_size;
+		entry->mtime = fde->mtime;
+		g_hash_table_replace(mount_obj->kernel_cached, g_strdup(fde->relative_path), entry);
+	}
+
+	g_static_mutex_unlock(&mount_obj->kernel_cache_lock);
 	return ret;
 }
 
-static void insert_fdtable_entry(struct vcachefs_mount* mount_obj, struct vcachefs_fdentry* fde)
+static const char* tier_relative_path(struct vcachefs_tier* tier, const char* full_path)
 {
-	g_hash_table_insert(mount_obj->fd_table, &fde->fd, fde);
+	/* The cache managers hand us full paths, but everything else is
+	 * filed by its path relative to the mount */
+	size_t root_len = strlen(tier->cache_path);
+	return (strncmp(full_path, tier->cache_path, root_len) ? full_path : full_path + root_len);
+}
 
-	GSList* iter;
-	if ( !(iter = g_hash_table_lookup(mount_obj->fd_table_byname, fde->relative_path)) ) {
-		iter = g_slist_prepend(iter, fde);
-		g_hash_table_insert(mount_obj->fd_table_byname, fde->relative_path, iter);
-	} else {
-		iter = g_slist_prepend(iter, fde);
-		g_hash_table_replace(mount_obj->fd_table_byname, fde->relative_path, iter);
+static gboolean tier_is_last(struct vcachefs_tier* tier)
+{
+	return (tier->index + 1 >= tier->mount->tiers->len);
+}
+
+static void filter_deletable_cached_files(const char** paths, gboolean* deletable, guint count, gpointer context)
+{
+	/* Blowing away files who we have an open handle to is probably bad */
+	struct vcachefs_tier* tier = context;
+	struct vcachefs_mount* mount_obj = tier->mount;
+	guint i;
+
+	for(i=0; i < count; i++) {
+		const char* relative_path = tier_relative_path(tier, paths[i]);
+		deletable[i] = !handle_table_has_path(mount_obj->handles, relative_path);
+
+		/* Anything we say yes to in the last tier is about to go away,
+		 * so the kernel shouldn't hang on to it either */
+		if (deletable[i] && tier_is_last(tier))
+			kernel_cache_forget(mount_obj, relative_path);
 	}
 }
 
-static gpointer force_terminate_on_ioblock(gpointer dontcare)
+/* 
+ * Cache tiers
+ */
+
+/* The cache can be spread over several directories, fastest first, each
+ * with its own budget and its own cache manager. Fills always land in the
+ * first tier; when a tier evicts something, it gets moved down to the next
+ * one instead of being deleted, and only falls out of the last one. When a
+ * file that's been demoted gets opened again, and the first tier would
+ * admit it, it gets moved back up */
+
+static gboolean move_cached_file(struct vcachefs_mount* mount_obj, struct vcachefs_tier* from, 
+		struct vcachefs_tier* to, const char* relative_path)
 {
-	sleep(15);
-	kill(0, SIGKILL);
-	return 0;
+	gboolean ret = FALSE;
+	char* src_path = g_build_filename(from->cache_path, relative_path, NULL);
+	char* dest_path = g_build_filename(to->cache_path, relative_path, NULL);
+	int fd;
+
+	if (create_cache_parent(to->cache_path, relative_path) < 0)
+		goto out;
+
+	/* Tiers are usually on different disks, so rename is a long shot */
+	if (rename(src_path, dest_path) < 0) {
+		if (errno != EXDEV)
+			goto out;
+		/* NOTE: The copy keeps the mtime of the one we're moving, which
+		 * is the source's; it has to, or a copy that's gone stale since
+		 * the original fill would look fresh again */
+		if ( (fd = copy_file_and_return_destfd(from->cache_path, to->cache_path, 
+						relative_path, NULL, 1, &mount_obj->quitflag_atomic, NULL)) < 0)
+			goto out;
+		close(fd);
+		unlink(src_path);
+	}
+
+	stats_write_record(stats_file, (to->index > from->index ? "demote" : "promote"), 
+			from->index, to->index, relative_path);
+	cache_manager_notify_added(to->cache_manager, dest_path);
+	ret = TRUE;
+
+out:
+	g_free(src_path);
+	g_free(dest_path);
+	return ret;
 }
 
-static void trash_fdtable_byname_item(gpointer key, gpointer val, gpointer dontcare) 
-{ 
-	GSList* fde_list = val;
-	if (fde_list)
-		g_slist_free(fde_list);
+static gboolean demote_cached_file(const char* full_path, gpointer context)
+{
+	/* NOTE: This is the CMDemoteCallback for every tier but the last */
+	struct vcachefs_tier* tier = context;
+	struct vcachefs_mount* mount_obj = tier->mount;
+
+	if (g_atomic_int_get(&mount_obj->quitflag_atomic))
+		return FALSE;
+
+	return move_cached_file(mount_obj, tier, g_ptr_array_index(mount_obj->tiers, tier->index + 1), 
+			tier_relative_path(tier, full_path));
+}
+
+static void promote_workitem(gpointer relative_path, gpointer mount)
+{
+	struct vcachefs_mount* mount_obj = mount;
+	struct vcachefs_tier* first = g_ptr_array_index(mount_obj->tiers, 0);
+	guint i;
+
+	/* Find whoever has it now; if someone beat us to it, nobody will */
+	for(i=1; i < mount_obj->tiers->len && !g_atomic_int_get(&mount_obj->quitflag_atomic); i++) {
+		struct vcachefs_tier* tier = g_ptr_array_index(mount_obj->tiers, i);
+		char* full_path = g_build_filename(tier->cache_path, relative_path, NULL);
+		gboolean found = (access(full_path, F_OK) == 0);
+
+		if (found && move_cached_file(mount_obj, tier, first, relative_path))
+			cache_manager_notify_removed(tier->cache_manager, full_path);
+
+		g_free(full_path);
+		if (found)
+			break;
+	}
+
+	g_free(relative_path);
+}
+
+static void add_cache_tier(struct vcachefs_mount* mount_obj, const char* cache_path, guint64 max_size)
+{
+	struct vcachefs_tier* tier = g_new0(struct vcachefs_tier, 1);
+	tier->mount = mount_obj;
+	tier->index = mount_obj->tiers->len;
+	tier->cache_path = g_strdup(cache_path);
+	tier->max_size = max_size;
+
+	/* VCACHEFS_EVICTION_POLICY picks how we decide what to throw out: lru, 2q, or gdsf. 
+	 * Once the cache is full, files only get in if they're opened more
+	 * often than what they'd replace; VCACHEFS_ADMISSION_WIDTH=0 turns that
+	 * off. Only the first tier ever decides who gets in */
+	tier->cache_manager = cache_manager_new(cache_path, getenv("VCACHEFS_EVICTION_POLICY"), 
+			(tier->index == 0 ? get_env_size("VCACHEFS_ADMISSION_WIDTH", 64 * 1024) : 0), 
+			filter_deletable_cached_files, tier);
+
+	g_ptr_array_add(mount_obj->tiers, tier);
+}
+
+static void setup_cache_tiers(struct vcachefs_mount* mount_obj)
+{
+	/* The first tier is VCACHEFS_CACHEPATH (or ~/.vcachefs), holding up to
+	 * VCACHEFS_CACHE_SIZE; VCACHEFS_CACHE_TIERS lists slower ones after it,
+	 * as dir=size, separated by colons */
+	const char* env = getenv("VCACHEFS_CACHEPATH");
+	char* cache_root = (env ? g_strdup(env) : g_build_filename(getenv("HOME"), ".vcachefs", NULL));
+	char* cache_path = build_cache_path(cache_root, mount_obj->source_path);
+	guint i;
+
+	mount_obj->tiers = g_ptr_array_new();
+	add_cache_tier(mount_obj, cache_path, get_env_size("VCACHEFS_CACHE_SIZE", 20 * 1024 * 1024));
+	g_free(cache_path);
+	g_free(cache_root);
+
+	if ( (env = getenv("VCACHEFS_CACHE_TIERS")) ) {
+		gchar** tiers = g_strsplit(env, ":", 0);
+		for(i=0; tiers[i]; i++) {
+			gchar** parts = g_strsplit(tiers[i], "=", 2);
+			guint64 size = (parts[0] && parts[1] ? parse_size(parts[1], 0) : 0);
+
+			if (size > 0) {
+				cache_path = build_cache_path(parts[0], mount_obj->source_path);
+				add_cache_tier(mount_obj, cache_path, size);
+				g_free(cache_path);
+			} else if (*tiers[i]) {
+				g_warning("Ignoring cache tier '%s', it needs to be dir=size", tiers[i]);
+			}
+			g_strfreev(parts);
+		}
+		g_strfreev(tiers);
+	}
+
+	for(i=0; i < mount_obj->tiers->len; i++) {
+		struct vcachefs_tier* tier = g_ptr_array_index(mount_obj->tiers, i);
+		guint64 high, low;
+		if (!tier_is_last(tier))
+			cache_manager_set_demote_callback(tier->cache_manager, demote_cached_file, tier);
+		get_watermarks(tier->max_size, &high, &low);
+		cache_manager_start_evictor(tier->cache_manager, high, low);
+	}
+
+	/* Everyone else only ever deals with the first one */
+	struct vcachefs_tier* first = g_ptr_array_index(mount_obj->tiers, 0);
+	mount_obj->cache_path = g_strdup(first->cache_path);
+	mount_obj->cache_manager = first->cache_manager;
+	mount_obj->max_cache_size = first->max_size;
+}
+
+static void free_cache_tiers(struct vcachefs_mount* mount_obj)
+{
+	/* NOTE: We go fastest first, so nobody's evictor is still around to
+	 * demote into a tier we've already freed */
+	guint i;
+	for(i=0; i < mount_obj->tiers->len; i++) {
+		struct vcachefs_tier* tier = g_ptr_array_index(mount_obj->tiers, i);
+		cache_manager_free(tier->cache_manager);
+		g_free(tier->cache_path);
+		g_free(tier);
+	}
+
+	g_ptr_array_free(mount_obj->tiers, TRUE);
+	mount_obj->tiers = NULL;
+	mount_obj->cache_manager = NULL;
 }
 
-static void trash_fdtable_item(gpointer key, gpointer val, gpointer dontcare) 
+/* Stupid struct to pass a tuple through to this fn */
+struct ioblock_watchdog {
+	GMutex* lock;
+	GCond* cond;
+	gboolean done;
+};
+
+static gpointer force_terminate_on_ioblock(gpointer watchdog)
+{
+	struct ioblock_watchdog* wd = watchdog;
+	GTimeVal deadline;
+	g_get_current_time(&deadline);
+	g_time_val_add(&deadline, 15 * 1000 * 1000);
+
+	g_mutex_lock(wd->lock);
+	while (!wd->done && g_cond_timed_wait(wd->cond, wd->lock, &deadline))
+		;
+	gboolean done = wd->done;
+	g_mutex_unlock(wd->lock);
+
+	if (!done)
+		kill(0, SIGKILL);
+	return 0;
+}
+
+static void trash_fdtable_item(gpointer val, gpointer dontcare) 
 { 
 	fdentry_unref((struct vcachefs_fdentry*)val);
 }
@@ -328,78 +940,157 @@ static void trash_fdtable_item(gpointer key, gpointer val, gpointer dontcare)
 
 
 /*
- * FUSE callouts
+ * Mount operations
+ *
+ * These do the actual work for both the path-based and the inode-based
+ * FUSE frontends, so they take the mount explicitly instead of digging it
+ * out of the FUSE context
  */
 
-static void* vcachefs_init(struct fuse_conn_info *conn)
+struct vcachefs_mount* vcachefs_mount_new(void)
 {
 	struct vcachefs_mount* mount_object = g_new0(struct vcachefs_mount, 1);
 	mount_object->source_path = g_strdup(getenv("VCACHEFS_TARGET"));
-	mount_object->cache_path = build_cache_path(mount_object->source_path);
-
-	/* TODO: This is actually a config param */
-	mount_object->max_cache_size = 20 * 1024 * 1024;
 
 	if (getenv("VCACHEFS_PASSTHROUGH"))
 		mount_object->pass_through = 1;
 
+	/* Files at least this big get cached a block at a time instead of
+	 * being copied whole */
+	mount_object->block_threshold = get_env_size("VCACHEFS_BLOCK_THRESHOLD", 64 * 1024 * 1024);
+
 	g_thread_init(NULL);
 
 	stats_file = stats_open_logging();
 
-	/* Create the file descriptor tables */
-	mount_object->fd_table = g_hash_table_new(g_int_hash, g_int_equal);
-	mount_object->fd_table_byname = g_hash_table_new(g_str_hash, g_str_equal);
-	g_static_rw_lock_init(&mount_object->fd_table_rwlock);
-	mount_object->next_fd = 4;
+	/* Create the file handle table */
+	mount_object->handles = handle_table_new();
+
+	mount_object->fills_in_flight = g_hash_table_new_full(g_str_hash, g_str_equal, 
+			g_free, (GDestroyNotify)fill_progress_unref);
+	g_static_mutex_init(&mount_object->fills_lock);
+
+	if (getenv("VCACHEFS_KERNEL_CACHE"))
+		mount_object->kernel_cache = 1;
+	mount_object->kernel_cached = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	g_static_mutex_init(&mount_object->kernel_cache_lock);
 
-	mount_object->cache_manager = cache_manager_new(mount_object->cache_path, can_delete_cached_file, mount_object);
+	setup_cache_tiers(mount_object);
 	mount_object->work_queue = workitem_queue_new();
 
-	/* Set up the file cache thread */
-	mount_object->file_copy_queue = g_async_queue_new();
-	mount_object->file_copy_thread = g_thread_create(file_cache_copy_thread, mount_object, TRUE/*joinable*/, NULL);
+	/* Promotions can mean copying a big file between disks, so they get a
+	 * thread of their own instead of holding up the work queue */
+	if (mount_object->tiers->len > 1)
+		mount_object->promote_pool = g_thread_pool_new(promote_workitem, mount_object, 1, FALSE, NULL);
+
+	mount_object->fill_record_root = g_strdup_printf("%s.fills", mount_object->cache_path);
+	g_mkdir_with_parents(mount_object->fill_record_root, 5+7*8+7*8*8);
+
+	char* block_root = g_strdup_printf("%s.blocks", mount_object->cache_path);
+	mount_object->block_cache = block_cache_new(block_root, get_env_size("VCACHEFS_BLOCK_SIZE", 1024 * 1024));
+	g_free(block_root);
+
+	/* Once the block cache outgrows VCACHEFS_BLOCK_CACHE_SIZE, the coldest
+	 * parts of files get punched back out, using the same watermarks as
+	 * the file cache */
+	guint64 high, low;
+	get_watermarks(get_env_size("VCACHEFS_BLOCK_CACHE_SIZE", 4ULL * 1024 * 1024 * 1024), &high, &low);
+	block_cache_start_reclaimer(mount_object->block_cache, high, low);
+
+	mount_object->readahead_min = get_env_size("VCACHEFS_READAHEAD_MIN", 2 * 1024 * 1024);
+	mount_object->readahead_max = get_env_size("VCACHEFS_READAHEAD_MAX", 32 * 1024 * 1024);
+	guint64 readahead_threads = get_env_size("VCACHEFS_READAHEAD_THREADS", 4);
+	if (readahead_threads > 0)
+		mount_object->readahead_pool = g_thread_pool_new(readahead_thread, mount_object, readahead_threads, FALSE, NULL);
+
+	char* meta_root = g_strdup_printf("%s.meta", mount_object->cache_path);
+	mount_object->meta_cache = meta_cache_new(meta_root, 
+			get_env_size("VCACHEFS_HEAD_SIZE", 128 * 1024), get_env_size("VCACHEFS_TAIL_SIZE", 64 * 1024));
+	g_free(meta_root);
+	get_watermarks(get_env_size("VCACHEFS_META_CACHE_SIZE", 256 * 1024 * 1024), &high, &low);
+	meta_cache_start_evictor(mount_object->meta_cache, high, low);
+
+	if (!mount_object->pass_through) {
+		mount_object->attr_ttl = get_env_size("VCACHEFS_ATTR_TTL", 10);
+		mount_object->negative_ttl = get_env_size("VCACHEFS_NEGATIVE_TTL", 10);
+		mount_object->attr_cache = attr_cache_new(mount_object->attr_ttl, mount_object->negative_ttl);
+		mount_object->dir_cache = dir_cache_new(get_env_size("VCACHEFS_DIRCACHE_SIZE", 1024));
+	}
+	mount_object->stat_pool = stat_pool_new(get_env_size("VCACHEFS_STAT_THREADS", 16));
+
+	/* Small, hot stuff gets kept in memory; files this small skip the
+	 * splice path so their reads can be picked up here */
+	if (!mount_object->pass_through) {
+		mount_object->ram_cache = ram_cache_new(get_env_size("VCACHEFS_RAM_CACHE", 32 * 1024 * 1024), 
+				get_env_size("VCACHEFS_RAM_BLOCK_SIZE", 64 * 1024));
+		mount_object->ram_max_file = get_env_size("VCACHEFS_RAM_MAX_FILE", 1024 * 1024);
+	}
+
+	/* Set up the file cache workers; each one fills big files over
+	 * several streams at once */
+	mount_object->fill_streams = MAX(get_env_size("VCACHEFS_FILL_STREAMS", 4), 1);
+	mount_object->copy_queue = copy_queue_new(get_env_size("VCACHEFS_COPY_THREADS", 4), 
+			file_cache_copy, NULL, mount_object);
+
+	resume_pending_fills(mount_object);
 
 	stats_write_record(stats_file, "init_target", 0, 0, mount_object->cache_path);
 
 	return mount_object;
 }
 
-static void vcachefs_destroy(void *mount_object_ptr)
+void vcachefs_mount_free(struct vcachefs_mount* mount_object)
 {
-	struct vcachefs_mount* mount_object = mount_object_ptr;
-
 	/* Kick off a watchdog thread; this is our last chance to bail; while
 	 * Mac and Linux both support async IO for reads/writes, if a remote FS
 	 * wanders off on an access or readdir call, there's absolutely zilch
 	 * that we can do about it, except for force kill everyone involved. */
-	g_thread_create(force_terminate_on_ioblock, NULL, FALSE, NULL);
+	struct ioblock_watchdog wd = { g_mutex_new(), g_cond_new(), FALSE };
+	GThread* watchdog = g_thread_create(force_terminate_on_ioblock, &wd, TRUE, NULL);
 
-	/* Signal the file cache thread to terminate and wait for it
-	 * XXX: if the thread hangs, we're boned - no way to timeout this */
+	/* Signal the file cache workers to terminate and wait for them; they
+	 * save how far they got on the way out, and even if the watchdog gets
+	 * them first, at most one checkpoint's worth of copying is lost */
 	g_atomic_int_set(&mount_object->quitflag_atomic, 1);
-	g_thread_join(mount_object->file_copy_thread);
+	copy_queue_free(mount_object->copy_queue);
 
-	/* Free the async queue */
-	char* item;
-	g_async_queue_lock(mount_object->file_copy_queue);
-	while ( (item = g_async_queue_try_pop_unlocked(mount_object->file_copy_queue)) ) {
-		if (item)
-			g_free(item);
-	}
-	g_async_queue_unlock(mount_object->file_copy_queue);
-	g_async_queue_unref(mount_object->file_copy_queue);
+	/* Anything still queued will see the quit flag and just let go */
+	if (mount_object->readahead_pool)
+		g_thread_pool_free(mount_object->readahead_pool, FALSE, TRUE);
+	if (mount_object->promote_pool)
+		g_thread_pool_free(mount_object->promote_pool, FALSE, TRUE);
 
 	workitem_queue_free(mount_object->work_queue);
-	cache_manager_free(mount_object->cache_manager);
+
+	/* Nobody's talking to the source anymore, so the watchdog can stand
+	 * down; everything after this is local, and has to get to finish so
+	 * the maps and indexes get saved */
+	g_mutex_lock(wd.lock);
+	wd.done = TRUE;
+	g_cond_signal(wd.cond);
+	g_mutex_unlock(wd.lock);
+	if (watchdog)
+		g_thread_join(watchdog);
+	g_mutex_free(wd.lock);
+	g_cond_free(wd.cond);
+
+	free_cache_tiers(mount_object);
+	g_hash_table_destroy(mount_object->fills_in_flight);
+	g_static_mutex_free(&mount_object->fills_lock);
+	g_hash_table_destroy(mount_object->kernel_cached);
+	g_static_mutex_free(&mount_object->kernel_cache_lock);
 
 	/* XXX: We need to make sure no one is using this before we trash it */
-	g_hash_table_foreach(mount_object->fd_table, trash_fdtable_item, NULL);
-	g_hash_table_foreach(mount_object->fd_table_byname, trash_fdtable_byname_item, NULL);
-	g_hash_table_destroy(mount_object->fd_table);
-	g_hash_table_destroy(mount_object->fd_table_byname);
-	mount_object->fd_table = NULL;
-	mount_object->fd_table_byname = NULL;
+	handle_table_foreach(mount_object->handles, trash_fdtable_item, NULL);
+	handle_table_free(mount_object->handles);
+	mount_object->handles = NULL;
+	block_cache_free(mount_object->block_cache);
+	meta_cache_free(mount_object->meta_cache);
+	attr_cache_free(mount_object->attr_cache);
+	dir_cache_free(mount_object->dir_cache);
+	stat_pool_free(mount_object->stat_pool);
+	ram_cache_free(mount_object->ram_cache);
+	g_free(mount_object->fill_record_root);
 	g_free(mount_object->cache_path);
 	g_free(mount_object->source_path);
 	g_free(mount_object);
@@ -414,13 +1105,58 @@ static int is_quitting(struct vcachefs_mount* mount_obj)
 	return (g_atomic_int_get(&mount_obj->quitflag_atomic) != 0);
 }
 
-/* File ops callouts */
+static int stat_source_path(struct vcachefs_mount* mount_obj, const char* path, struct stat* stbuf)
+{
+	int ret = 0;
 
-static int vcachefs_getattr(const char *path, struct stat *stbuf)
+	if (attr_cache_lookup(mount_obj->attr_cache, path, stbuf, &ret))
+		return ret;
+
+	if(strcmp(path, "/") == 0) {
+		ret = stat(mount_obj->source_path, stbuf);
+	} else {
+		gchar* full_path = g_build_filename(mount_obj->source_path, &path[1], NULL);
+		ret = stat((char *)full_path, stbuf);
+		g_free(full_path);
+	}
+
+	if (ret == 0) {
+		attr_cache_insert(mount_obj->attr_cache, path, stbuf);
+	} else {
+		ret = -errno;
+		if (ret == -ENOENT)
+			attr_cache_insert_negative(mount_obj->attr_cache, path);
+	}
+
+	return ret;
+}
+
+static int access_from_stat(const struct stat* st, int amode)
 {
-	int ret = 0; 
-	struct vcachefs_mount* mount_obj = get_current_mountinfo();
+	/* Figure out what we'd get from access() using the permission bits.
+	 * This can't see supplementary groups or ACLs, so we only trust it 
+	 * when it says yes */
+	int want = 0, have;
+	if (amode == F_OK)
+		return 0;
+
+	if (amode & R_OK)	want |= 4;
+	if (amode & W_OK)	want |= 2;
+	if (amode & X_OK)	want |= 1;
+
+	if (geteuid() == st->st_uid) {
+		have = (st->st_mode >> 6) & 7;
+	} else if (getegid() == st->st_gid) {
+		have = (st->st_mode >> 3) & 7;
+	} else {
+		have = st->st_mode & 7;
+	}
+
+	return ((have & want) == want ? 0 : -EACCES);
+}
 
+int vcachefs_mount_getattr(struct vcachefs_mount* mount_obj, const char *path, struct stat *stbuf)
+{
 	if(path == NULL || strlen(path) == 0) {
 		return -ENOENT;
 	}
@@ -430,20 +1166,62 @@ static int vcachefs_getattr(const char *path, struct stat *stbuf)
 		return -EIO;
 
 	stats_write_record(stats_file, "getattr", 0, 0, path);
-	if(strcmp(path, "/") == 0) {
-		return (stat(mount_obj->source_path, stbuf) ? -errno : 0);
+	return stat_source_path(mount_obj, path, stbuf);
+}
+
+static int validate_cached_copy(struct vcachefs_mount* mount_obj, const char* path, int cache_fd, 
+		struct stat* cache_st, time_t* source_mtime)
+{
+	/* A copy is good as long as the source hasn't changed since we made
+	 * it. If we can't get to the source at all, the copy's the best we've
+	 * got; if the source is gone, so is the file.
+	 *
+	 * NOTE: This stats the source (by path) on every open, so a cache hit
+	 * never has to wait on opening the real file; the attribute cache
+	 * answers for VCACHEFS_ATTR_TTL seconds after the last stat, so a
+	 * change to the source can go unnoticed for that long */
+	struct stat source_st;
+	int err;
+
+	if (fstat(cache_fd, cache_st) < 0 || !S_ISREG(cache_st->st_mode))
+		return -ESTALE;
+
+	*source_mtime = cache_st->st_mtime;
+	if ( (err = stat_source_path(mount_obj, path, &source_st)) ) {
+		return (err == -ENOENT ? err : 0);
 	}
 
-	gchar* full_path = g_build_filename(mount_obj->source_path, &path[1], NULL);
-	ret = stat((char *)full_path, stbuf);
+	if (source_st.st_size != cache_st->st_size || !same_mtime(&source_st, cache_st))
+		return -ESTALE;
+
+	*source_mtime = source_st.st_mtime;
+	return 0;
+}
+
+static int fdentry_get_source_fd(struct vcachefs_mount* mount_obj, struct vcachefs_fdentry* fde)
+{
+	int fd = g_atomic_int_get(&fde->source_fd);
+	if (fd >= 0)
+		return fd;
+
+	/* We opened from the cache, and now we need the real thing */
+	gchar* full_path = g_build_filename(mount_obj->source_path, &fde->relative_path[1], NULL);
+	fd = open(full_path, fde->open_flags, 0);
 	g_free(full_path);
+	if (fd < 0)
+		return -1;
 
-	return (ret ? -errno : 0);
+	/* Maybe some thread beat us to it? */
+	if (!g_atomic_int_compare_and_exchange(&fde->source_fd, -1, fd)) {
+		close(fd);
+		fd = g_atomic_int_get(&fde->source_fd);
+	}
+
+	return fd;
 }
 
-static int vcachefs_open(const char *path, struct fuse_file_info *fi)
+int vcachefs_mount_open(struct vcachefs_mount* mount_obj, const char *path, int flags, struct vcachefs_fdentry** fde_out)
 {
-	struct vcachefs_mount* mount_obj = get_current_mountinfo();
 	struct vcachefs_fdentry* fde = NULL;
 
 	if(path == NULL || strlen(path) == 0) {
@@ -454,136 +1232,241 @@ static int vcachefs_open(const char *path, struct fuse_file_info *fi)
 	if(is_quitting(mount_obj))
 		return -EIO;
 
-	gchar* full_path = g_build_filename(mount_obj->source_path, &path[1], NULL);
+	/* If we've got a good copy in the cache, we don't need the source
+	 * at all until a read goes wrong */
+	int cache_fd = -1;
+	struct stat st;
+	time_t source_mtime;
+	struct vcachefs_tier* tier = NULL;
+	if (!mount_obj->pass_through &&
+	    (tier = open_from_cache_tiers(mount_obj, path, flags, &cache_fd))) {
+		int err = validate_cached_copy(mount_obj, path, cache_fd, &st, &source_mtime);
+		if (err == 0) {
+			fde = fdentry_new();
+			fde->relative_path = g_strdup(path);
+			fde->open_flags = flags;
+			fde->filecache_fd = cache_fd;
+			fde->file_size = st.st_size;
+			fde->mtime = source_mtime;
+			goto cached;
+		}
+
+		/* The source changed out from under us, our copy is junk, and
+		 * so is anything the kernel kept from it */
+		close(cache_fd);
+		gchar* stale_path = g_build_filename(tier->cache_path, path, NULL);
+		cache_manager_notify_removed(tier->cache_manager, stale_path);
+		g_free(stale_path);
+		kernel_cache_forget(mount_obj, path);
+		tier = NULL;
+
+		if (err == -ENOENT)
+			return err;
+	}
 
-	int source_fd = open(full_path, fi->flags, 0);
-	if(source_fd <= 0) 
+	gchar* full_path = g_build_filename(mount_obj->source_path, &path[1], NULL);
+	int source_fd = open(full_path, flags, 0);
+	g_free(full_path);
+	if(source_fd < 0)
 		return -errno;
 
 	/* Open succeeded - time to create a fdentry */
 	fde = fdentry_new();
 	fde->relative_path = g_strdup(path);
+	fde->open_flags = flags;
 	fde->source_fd = source_fd;
-	fde->source_offset = 0;
-
-	g_static_rw_lock_writer_lock(&mount_obj->fd_table_rwlock);
-	fi->fh = fde->fd = mount_obj->next_fd;
-	mount_obj->next_fd++;
-	insert_fdtable_entry(mount_obj, fde);
-	g_static_rw_lock_writer_unlock(&mount_obj->fd_table_rwlock);
 
 	if (mount_obj->pass_through)
 		goto out;
 
-	/* Try to open the file cached version; if it's not there, add it to the fetch list */
-	if( (fde->filecache_fd = try_open_from_cache(mount_obj->cache_path, path, fi->flags)) == -1 && errno == ENOENT) {
-		g_async_queue_push(mount_obj->file_copy_queue, g_strdup(path));
+	/* The file isn't cached, so either hand big files to the block cache
+	 * or mark it to be fetched once someone reads more than the tags */
+	if (fstat(source_fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		fde->file_size = st.st_size;
+		fde->mtime = st.st_mtime;
+
+		if (mount_obj->meta_cache && 
+		    !(fde->meta_entry = meta_cache_lookup(mount_obj->meta_cache, path, &st))) {
+			workitem_queue_insert(mount_obj->work_queue, meta_cache_fill_workitem, 
+					g_strdup(path), mount_obj, g_free);
+		}
+
+		if (mount_obj->block_cache && st.st_size >= mount_obj->block_threshold)
+			fde->block_file = block_cache_open(mount_obj->block_cache, path, &st);
 	}
 
-	/* Touch the file so it doesn't get reclaimed by the cache manager */
-	if (fde->filecache_fd) {
-		gchar* full_cache_path = g_build_filename(mount_obj->cache_path, path, NULL);
-		cache_manager_touch_file(mount_obj->cache_manager, full_cache_path);
-		g_free(full_cache_path);
+	if (!fde->block_file)
+		fde->needs_copy = 1;
+
+cached:
+	fde->ram_id = ram_cache_get_id(mount_obj->ram_cache, path, fde->file_size, fde->mtime);
+
+	/* Count the open, and touch the file so it doesn't get reclaimed by
+	 * the cache manager */
+	gchar* full_cache_path = g_build_filename(mount_obj->cache_path, path, NULL);
+	cache_manager_notify_opened(mount_obj->cache_manager, full_cache_path);
+	if (tier && tier->index == 0) {
+		cache_manager_touch_file(tier->cache_manager, full_cache_path);
+	} else if (tier) {
+		/* It's hot again; if the first tier would take it, move it back up */
+		gchar* tier_path = g_build_filename(tier->cache_path, path, NULL);
+		cache_manager_touch_file(tier->cache_manager, tier_path);
+		if (cache_manager_should_admit(mount_obj->cache_manager, full_cache_path, 
+					fde->file_size, mount_obj->max_cache_size))
+			g_thread_pool_push(mount_obj->promote_pool, g_strdup(path), NULL);
+		g_free(tier_path);
 	}
+	g_free(full_cache_path);
 
 out:
-	
+	/* Now that everything's set up, let other threads see it */
+	*fde_out = fde;
+	handle_table_insert(mount_obj->handles, fde->relative_path, fde);
+
 	/* FUSE handles this differently */
 	stats_write_record(stats_file, "open", 0, 0, path);
 	return 0;
 }
 
-static int read_from_fd(int fd, off_t* cur_offset, char* buf, size_t size, off_t offset)
+static int read_from_fd(int fd, char* buf, size_t size, off_t offset)
 {
-	int ret = 0;
-
-	if(*cur_offset != offset) {
-		int tmp = lseek(fd, offset, SEEK_SET);
-		if (tmp < 0) {
-			ret = tmp;
-			goto out;
-		}
+	/* NOTE: We never touch the fd's offset, so any number of threads can
+	 * read from the same handle at once */
+	if (fd < 0) {
+		errno = EBADF;
+		return -1;
 	}
 
-	ret = read(fd, buf, size);
-	if (ret >= 0)
-		*cur_offset = offset + ret;
-out:
-	return ret;
+	return pread(fd, buf, size, offset);
 }
 
-static int vcachefs_read(const char *path, char *buf, size_t size, off_t offset,
-		struct fuse_file_info *fi)
+int vcachefs_mount_read(struct vcachefs_mount* mount_obj, struct vcachefs_fdentry* fde, 
+		char *buf, size_t size, off_t offset)
 {
 	int ret = 0;
-	struct vcachefs_mount* mount_obj = get_current_mountinfo();
-	struct vcachefs_fdentry* fde = fdentry_from_fd(fi->fh);
+	gboolean promote = FALSE;
+	const char* path;
 	if(!fde)
 		return -ENOENT;
 
+	fdentry_ref(fde);
+	path = fde->relative_path;
+
 	/* On shutdown, fail new requests */
-	if(is_quitting(mount_obj))
+	if(is_quitting(mount_obj)) {
+		fdentry_unref(fde);
 		return -EIO;
+	}
 
-	/* Let's see if we can do this read from the file cache */
+	/* Memory first, then the file cache */
 	if (!mount_obj->pass_through &&
-	    (ret = read_from_fd(fde->filecache_fd, &fde->filecache_offset, buf, size, offset)) >= 0) {
+	    (ret = ram_cache_read(mount_obj->ram_cache, fde->ram_id, buf, size, offset)) >= 0) {
+		stats_write_record(stats_file, "ram_read", size, offset, path);
+		goto out;
+	}
+
+	if (!mount_obj->pass_through &&
+	    (ret = read_from_fd(g_atomic_int_get(&fde->filecache_fd), buf, size, offset)) >= 0) {
 		stats_write_record(stats_file, "cached_read", size, offset, path);
+		promote = TRUE;
+		goto out;
+	}
+
+	if (!mount_obj->pass_through && meta_cache_covers(mount_obj->meta_cache, fde->file_size, size, offset)) {
+		/* Tag reads come out of the head/tail cache, and never kick off
+		 * a copy of the whole file */
+		if ((ret = meta_cache_entry_read(fde->meta_entry, buf, size, offset)) >= 0) {
+			stats_write_record(stats_file, "meta_read", size, offset, path);
+			promote = TRUE;
+			goto out;
+		}
+	} else if (g_atomic_int_compare_and_exchange(&fde->needs_copy, 1, 0)) {
+		/* Don't bother copying files that won't stick around */
+		gchar* full_cache_path = g_build_filename(mount_obj->cache_path, path, NULL);
+		if (cache_manager_should_admit(mount_obj->cache_manager, full_cache_path, 
+					fde->file_size, mount_obj->max_cache_size))
+			copy_queue_push(mount_obj->copy_queue, path);
+		else
+			stats_write_record(stats_file, "copy_rejected", 0, 0, path);
+		g_free(full_cache_path);
+	}
+
+	/* If the copy is running, whatever has landed already is as good as
+	 * the cached file */
+	if (!mount_obj->pass_through && !fde->block_file && !g_atomic_int_get(&fde->needs_copy) &&
+	    (ret = fill_progress_read(fill_in_flight_for(mount_obj, fde), buf, size, offset)) >= 0) {
+		stats_write_record(stats_file, "partial_read", size, offset, path);
+		promote = TRUE;
+		goto out;
+	}
+
+	/* Big files get pulled in block by block */
+	if (!mount_obj->pass_through && fde->block_file) {
+		stats_write_record(stats_file, "block_read", size, offset, path);
+		update_readahead(mount_obj, fde, size, offset);
+		ret = block_cache_read(fde->block_file, fde->source_fd, buf, size, offset);
+		promote = TRUE;
 		goto out;
 	}
 
 	stats_write_record(stats_file, "uncached_read", size, offset, path);
-	ret = read_from_fd(fde->source_fd, &fde->source_offset, buf, size, offset);
+	int source_fd = fdentry_get_source_fd(mount_obj, fde);
+	ret = (source_fd < 0 ? -1 : read_from_fd(source_fd, buf, size, offset));
 
 out:
+	/* Anything that came out of a cache is worth keeping in memory; a
+	 * short read isn't necessarily the end of the file (a block fetch can
+	 * fail partway), so only the file's size gets to say that */
+	if (promote && ret >= 0)
+		ram_cache_insert(mount_obj->ram_cache, fde->ram_id, buf, ret, offset, 
+				offset + ret >= fde->file_size);
+
+	if (ret < 0)
+		ret = -errno;
 	fdentry_unref(fde);
-	return (ret < 0 ? -errno : ret);
+	return ret;
 }
 
-static int vcachefs_statfs(const char *path, struct statvfs *stat)
+int vcachefs_mount_read_fd(struct vcachefs_mount* mount_obj, struct vcachefs_fdentry* fde, 
+		size_t* size, off_t offset)
 {
-	struct vcachefs_mount* mount_obj = get_current_mountinfo();
+	/* If the whole file is sitting in the cache, the frontend can hand
+	 * the fd straight to FUSE and let the kernel splice it over, instead
+	 * of us copying it through a buffer. The fd stays open until the last
+	 * ref goes away, and FUSE won't release a handle mid-read; a read past
+	 * the end just comes back short */
+	int fd;
+	if (!fde || mount_obj->pass_through || is_quitting(mount_obj))
+		return -1;
+
+	if ( (fd = g_atomic_int_get(&fde->filecache_fd)) < 0)
+		return -1;
 
+	/* Small files are better off coming out of memory */
+	if (mount_obj->ram_cache && fde->file_size <= mount_obj->ram_max_file)
+		return -1;
+
+	stats_write_record(stats_file, "cached_read", *size, offset, fde->relative_path);
+	return fd;
+}
+
+int vcachefs_mount_statfs(struct vcachefs_mount* mount_obj, struct statvfs *stat)
+{
 	/* On shutdown, fail new requests */
 	if(is_quitting(mount_obj))
 		return -EIO;
 
-	return statvfs(mount_obj->source_path, stat);
+	return (statvfs(mount_obj->source_path, stat) < 0 ? -errno : 0);
 }
 
-static int vcachefs_release(const char *path, struct fuse_file_info *info)
+int vcachefs_mount_release(struct vcachefs_mount* mount_obj, struct vcachefs_fdentry* fde)
 {
-	struct vcachefs_mount* mount_obj = get_current_mountinfo();
-	struct vcachefs_fdentry* fde = NULL;
-
 	/* On shutdown, fail new requests */
 	if(is_quitting(mount_obj))
 		return -EIO;
 
-	/* Remove the entry from the fd table */
-	g_static_rw_lock_writer_lock(&mount_obj->fd_table_rwlock);
-	fde = g_hash_table_lookup(mount_obj->fd_table, &info->fh);
-	if (fde) {
-		g_hash_table_remove(mount_obj->fd_table, &info->fh);
-		GSList* iter = g_hash_table_lookup(mount_obj->fd_table_byname, fde->relative_path);
-		if (iter) {
-			iter = g_slist_remove(iter, fde);
-		}
-
-		/* Update the table to point to the correct SList */
-
-		if (!iter) {
-			/* If the SList is empty, remove the entire relative path */
-			g_hash_table_remove(mount_obj->fd_table_byname, fde->relative_path);
-		} else {
-			g_hash_table_replace(mount_obj->fd_table_byname, fde->relative_path, iter);
-		}
-	}
-
-	g_static_rw_lock_writer_unlock(&mount_obj->fd_table_rwlock);
-
-	if(!fde)
+	/* Remove the entry from the handle table, and drop its ref */
+	if(!fde || !handle_table_remove(mount_obj->handles, fde->relative_path, fde))
 		return -ENOENT;
 
 	fdentry_unref(fde);
@@ -591,10 +1474,9 @@ static int vcachefs_release(const char *path, struct fuse_file_info *info)
 	return 0;
 }
 
-static int vcachefs_access(const char *path, int amode)
+int vcachefs_mount_access(struct vcachefs_mount* mount_obj, const char *path, int amode)
 {
 	int ret = 0; 
-	struct vcachefs_mount* mount_obj = get_current_mountinfo();
 
 	if(path == NULL || strlen(path) == 0)
 		return -ENOENT;
@@ -603,30 +1485,104 @@ static int vcachefs_access(const char *path, int amode)
 	if(is_quitting(mount_obj))
 		return -EIO;
 
-	if(!mount_obj->pass_through && strcmp(path, "/") == 0) {
+	/* If we've stat'ed this recently, we can usually answer without
+	 * going to the source */
+	struct stat st;
+	int err;
+	if(attr_cache_lookup(mount_obj->attr_cache, path, &st, &err) &&
+	   (err != 0 || access_from_stat(&st, amode) == 0)) {
 		stats_write_record(stats_file, "cached_access", amode, 0, path);
-		return access(mount_obj->source_path, amode);
+		return err;
 	}
 
 	stats_write_record(stats_file, "uncached_access", amode, 0, path);
-	gchar* full_path = g_build_filename(mount_obj->source_path, &path[1], NULL);
-	ret = access((char *)full_path, amode);
-	g_free(full_path);
+	if(strcmp(path, "/") == 0) {
+		ret = access(mount_obj->source_path, amode);
+	} else {
+		gchar* full_path = g_build_filename(mount_obj->source_path, &path[1], NULL);
+		ret = access((char *)full_path, amode);
+		g_free(full_path);
+	}
 
-	return (ret < 0 ? errno : ret);
+	return (ret < 0 ? -errno : ret);
 
 }
 
-static int vcachefs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-		off_t offset, struct fuse_file_info *fi)
+/* Stupid struct to pass a tuple through to this fn */
+struct readdir_context {
+	DirSnapshotFunc func;
+	gpointer context;
+	int full;
+};
+
+static int fill_from_snapshot(const char* name, const struct stat* st, gpointer context)
+{
+	struct readdir_context* ctx = context;
+	return (ctx->full = (ctx->func)(name, st, ctx->context));
+}
+
+static struct DirSnapshot* snapshot_dir(struct vcachefs_mount* mount_obj, const char* path, 
+		DIR* dir, gboolean is_source, struct readdir_context* ctx)
+{
+	struct DirSnapshot* ret;
+	struct StatBatch* batch;
+	struct dirent* dentry;
+	struct stat dir_st;
+	struct stat stbuf;
+	char* name;
+	int stat_ret;
+	time_t taken_at = time(NULL);
+
+	if (fstat(dirfd(dir), &dir_st) != 0)
+		memset(&dir_st, 0, sizeof(dir_st));
+	else if (is_source)
+		attr_cache_insert(mount_obj->attr_cache, path, &dir_st);
+
+	ret = dir_snapshot_new(&dir_st, taken_at);
+
+	/* Grab all of the names, then stat them all at once; the cache has
+	 * fills' staging files in it, which nobody should see */
+	batch = stat_batch_new(mount_obj->stat_pool, dirfd(dir));
+	while((dentry = readdir(dir))) {
+		if (!is_source && g_str_has_suffix(dentry->d_name, ".partial"))
+			continue;
+		stat_batch_add(batch, dentry->d_name);
+	}
+
+	while(stat_batch_next(batch, &name, &stbuf, &stat_ret)) {
+		dir_snapshot_add(ret, name, (stat_ret == 0 ? &stbuf : NULL));
+
+		/* Hand entries to FUSE as soon as they come in */
+		if (ctx && !ctx->full)
+			fill_from_snapshot(name, (stat_ret == 0 ? &stbuf : NULL), ctx);
+
+		/* We're going to get asked about these in a second, so save
+		 * them off */
+		if (is_source && stat_ret == 0 && strcmp(name, ".") && strcmp(name, "..")) {
+			gchar* child_path = (strcmp(path, "/") == 0 ?
+					     g_strconcat("/", name, NULL) :
+					     g_strconcat(path, "/", name, NULL));
+			attr_cache_insert(mount_obj->attr_cache, child_path, &stbuf);
+			g_free(child_path);
+		}
+
+		g_free(name);
+	}
+	stat_batch_free(batch);
+
+	return ret;
+}
+
+int vcachefs_mount_readdir(struct vcachefs_mount* mount_obj, const char *path, 
+		DirSnapshotFunc func, gpointer context)
 {
-	int ret;
+	int ret = 0;
 	gchar* full_path = NULL;
- 	const gchar* next_path_try;
-	struct vcachefs_mount* mount_obj = get_current_mountinfo();
+	struct DirSnapshot* snapshot = NULL;
+	struct readdir_context ctx = { func, context, 0 };
+	struct stat dir_st;
+	gboolean streamed = FALSE;
 	DIR* dir = NULL;
-	struct dirent* dentry;
-	char path_buf[512];
 
 	if(path == NULL || strlen(path) == 0)
 		return -ENOENT;
@@ -635,32 +1591,51 @@ static int vcachefs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 	if(is_quitting(mount_obj))
 		return -EIO;
 
-	/* Try the source path first; if it's gone, retry with the cache */
-	next_path_try = mount_obj->source_path;
-	while (next_path_try) {
-		if(strcmp(path, "/") == 0) {
-			full_path = g_strdup(next_path_try);
-		} else {
-			full_path = g_build_filename(next_path_try, &path[1], NULL);
-		}
-		
-		/* Open the directory and read through it */
-		if ((dir = opendir(full_path)) != NULL) 
-			break;
-
-		next_path_try = (next_path_try == mount_obj->source_path && !mount_obj->pass_through ?
-				 mount_obj->cache_path : NULL);
-		g_free(full_path);
+	/* If the directory hasn't changed since we last listed it, we're done */
+	snapshot = dir_cache_lookup(mount_obj->dir_cache, path);
+	if (snapshot && stat_source_path(mount_obj, path, &dir_st) == 0 &&
+	    dir_snapshot_is_current(snapshot, &dir_st)) {
+		stats_write_record(stats_file, "cached_readdir", 0, 0, path);
+		goto fill;
 	}
 
-	/* No dice - bail */
-	if (dir == NULL) {
-		opendir(full_path);
+	stats_write_record(stats_file, "readdir", 0, 0, path);
+
+	/* Try the source path first */
+	full_path = (strcmp(path, "/") == 0 ? 
+		     g_strdup(mount_obj->source_path) : 
+		     g_build_filename(mount_obj->source_path, &path[1], NULL));
+
+	if ((dir = opendir(full_path)) != NULL) {
+		dir_snapshot_unref(snapshot);
+		snapshot = snapshot_dir(mount_obj, path, dir, TRUE, &ctx);
+		closedir(dir);
+		dir_cache_insert(mount_obj->dir_cache, path, snapshot);
+		streamed = TRUE;
+	} else if (snapshot) {
+		/* The source has gone away - hand back the last listing we saw */
+		stats_write_record(stats_file, "stale_readdir", 0, 0, path);
+	} else {
+		/* We've never seen this directory; if the source is gone, retry
+		 * with the cache */
+		ret = -errno;
+		if (mount_obj->pass_through)
+			goto out;
+
 		g_free(full_path);
-		return -errno;
-	}
+		full_path = (strcmp(path, "/") == 0 ? 
+			     g_strdup(mount_obj->cache_path) : 
+			     g_build_filename(mount_obj->cache_path, &path[1], NULL));
 
-	stats_write_record(stats_file, "readdir", offset, 0, path);
+		/* No dice - bail */
+		if ((dir = opendir(full_path)) == NULL)
+			goto out;
+
+		ret = 0;
+		snapshot = snapshot_dir(mount_obj, path, dir, FALSE, &ctx);
+		closedir(dir);
+		streamed = TRUE;
+	}
 
 	/* mkdir -p the cache directory */
 	if(strcmp(path, "/") != 0 && !mount_obj->pass_through) {
@@ -669,23 +1644,133 @@ static int vcachefs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 		g_free(cache_path);
 	}
 
-	while((dentry = readdir(dir))) {
-		struct stat stbuf;
-		int stat_ret;
+fill:
+	/* Fresh listings went out as they came in; cached ones go out now */
+	if (!streamed)
+		dir_snapshot_foreach(snapshot, fill_from_snapshot, &ctx);
+
+out:
+	dir_snapshot_unref(snapshot);
+	g_free(full_path);
+	return ret;
+}
 
-		/* Stat the file */
-		snprintf(path_buf, 512, "%s/%s", full_path, dentry->d_name);
-		stat_ret = stat(path_buf, &stbuf);
 
-		if ((ret = filler(buf, dentry->d_name, (stat_ret>=0 ? &stbuf : NULL), 0)))
-			goto out;
+/*
+ * FUSE callouts
+ */
+
+static void* vcachefs_init(struct fuse_conn_info *conn)
+{
+	/* Cached reads get spliced out of the cache file */
+	conn->want |= (conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE));
+	return vcachefs_mount_new();
+}
+
+static void vcachefs_destroy(void *mount_object_ptr)
+{
+	vcachefs_mount_free(mount_object_ptr);
+}
+
+static int vcachefs_getattr(const char *path, struct stat *stbuf)
+{
+	return vcachefs_mount_getattr(get_current_mountinfo(), path, stbuf);
+}
+
+static int vcachefs_open(const char *path, struct fuse_file_info *fi)
+{
+	struct vcachefs_mount* mount_obj = get_current_mountinfo();
+	struct vcachefs_fdentry* fde = NULL;
+	int ret = vcachefs_mount_open(mount_obj, path, fi->flags, &fde);
+	if (ret == 0) {
+		fi->fh = (gsize)fde;
+		fi->keep_cache = vcachefs_mount_keep_cache(mount_obj, fde);
 	}
+	return ret;
+}
 
-out:
-	closedir(dir);
+static int vcachefs_read(const char *path, char *buf, size_t size, off_t offset,
+		struct fuse_file_info *fi)
+{
+	return vcachefs_mount_read(get_current_mountinfo(), fdentry_from_fi(fi), buf, size, offset);
+}
+
+static int vcachefs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+		struct fuse_file_info *fi)
+{
+	/* NOTE: FUSE frees whatever we hand back here with free() */
+	struct vcachefs_mount* mount_obj = get_current_mountinfo();
+	struct vcachefs_fdentry* fde = fdentry_from_fi(fi);
+	struct fuse_bufvec* buf = malloc(sizeof(struct fuse_bufvec));
+	int ret, fd;
+
+	if (!buf)
+		return -ENOMEM;
+
+	if ( (fd = vcachefs_mount_read_fd(mount_obj, fde, &size, offset)) >= 0) {
+		*buf = FUSE_BUFVEC_INIT(size);
+		buf->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		buf->buf[0].fd = fd;
+		buf->buf[0].pos = offset;
+		*bufp = buf;
+		return 0;
+	}
+
+	/* Everything else still gets read into memory */
+	*buf = FUSE_BUFVEC_INIT(size);
+	if ( !(buf->buf[0].mem = malloc(size ? size : 1)) ) {
+		free(buf);
+		return -ENOMEM;
+	}
+
+	if ( (ret = vcachefs_mount_read(mount_obj, fde, buf->buf[0].mem, size, offset)) < 0) {
+		free(buf->buf[0].mem);
+		free(buf);
+		return ret;
+	}
+
+	buf->buf[0].size = ret;
+	*bufp = buf;
 	return 0;
 }
 
+static int vcachefs_statfs(const char *path, struct statvfs *stat)
+{
+	return vcachefs_mount_statfs(get_current_mountinfo(), stat);
+}
+
+static int vcachefs_release(const char *path, struct fuse_file_info *info)
+{
+	int ret = vcachefs_mount_release(get_current_mountinfo(), fdentry_from_fi(info));
+	if (ret == 0)
+		info->fh = 0;
+	return ret;
+}
+
+static int vcachefs_access(const char *path, int amode)
+{
+	return vcachefs_mount_access(get_current_mountinfo(), path, amode);
+}
+
+/* Stupid struct to pass a tuple through to this fn */
+struct filler_context {
+	void* buf;
+	fuse_fill_dir_t filler;
+};
+
+static int fill_from_filler(const char* name, const struct stat* st, gpointer context)
+{
+	struct filler_context* ctx = context;
+	return (ctx->filler)(ctx->buf, name, st, 0);
+}
+
+static int vcachefs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+		off_t offset, struct fuse_file_info *fi)
+{
+	struct filler_context ctx = { buf, filler };
+	return vcachefs_mount_readdir(get_current_mountinfo(), path, fill_from_filler, &ctx);
+}
+
 
 /*
  * Main
@@ -696,6 +1781,7 @@ static struct fuse_operations vcachefs_oper = {
 	/*.readlink 	= vcachefs_readlink, */
 	.open 		= vcachefs_open,
 	.read		= vcachefs_read,
+	.read_buf	= vcachefs_read_buf,
 	.statfs 	= vcachefs_statfs,
 	/* TODO: do we need flush? */
 	.release 	= vcachefs_release,
@@ -724,6 +1810,10 @@ int main(int argc, char *argv[])
 
 	/* Initialize libevent */
 	//ev_base = event_init();
+
+	/* VCACHEFS_LOWLEVEL picks the inode-based frontend */
+	if (getenv("VCACHEFS_LOWLEVEL"))
+		return vcachefs_lowlevel_main(argc, argv);
 	
 	return fuse_main(argc, argv, &vcachefs_oper, NULL);
 }
@@ -26,10 +26,22 @@
 
 #include <glib.h>
 
+#include "stdafx.h"
+#include "dircache.h"
+
 #ifndef uint
 #define uint 	unsigned int
 #endif
 
+/* One directory the file cache lives in; tiers are kept fastest first */
+struct vcachefs_tier {
+	struct vcachefs_mount* 	mount;
+	guint 			index;
+	char* 			cache_path;
+	guint64 		max_size;
+	struct CacheManager* 	cache_manager;
+};
+
 /* This object is the per-mount data we carry around with us throughout the 
  * life of the app until we release it */
 struct vcachefs_mount {
@@ -37,35 +49,121 @@ struct vcachefs_mount {
 	/* Configuration */
 	char* 	source_path;
 	char* 	cache_path;
-	gulong 	max_cache_size;
+	guint64 max_cache_size;
 	int 	pass_through;
 	
-	/* File descriptor table */
-	GHashTable* 	fd_table;
-	GHashTable* 	fd_table_byname;
-	uint 		next_fd;
-	GStaticRWLock 	fd_table_rwlock;
-
-	/* File-based caching */
-	GAsyncQueue* 		file_copy_queue;
-	GThread* 		file_copy_thread;
+	/* Open file handles, by path */
+	struct HandleTable* 	handles;
+
+	/* File-based caching; cache_path, cache_manager, and max_cache_size
+	 * all belong to the first tier, which is where fills land */
+	struct CopyQueue* 	copy_queue;
 	struct CacheManager* 	cache_manager;
+	GPtrArray* 		tiers;
+	GThreadPool* 		promote_pool;
+
+	/* Copies that are running right now, by relative path, so readers
+	 * can use whatever has landed so far */
+	GHashTable* 		fills_in_flight;
+	GStaticMutex 		fills_lock;
+
+	/* Where fills keep track of how far they've gotten, so they can
+	 * pick up after a restart */
+	char* 			fill_record_root;
+	guint 			fill_streams;
+
+	/* What we've let the kernel keep in its page cache, by relative
+	 * path, and how to tell it to let go when the frontend can */
+	int 			kernel_cache;
+	GHashTable* 		kernel_cached;
+	GStaticMutex 		kernel_cache_lock;
+	void 			(*invalidate)(const char* relative_path, gpointer context);
+	gpointer 		invalidate_context;
+
+	/* Recently read blocks, in memory */
+	struct RamCache* 	ram_cache;
+	guint64 		ram_max_file;
+
+	/* Block-based caching for files too big to copy whole */
+	struct BlockCache* 	block_cache;
+	guint64 		block_threshold;
+
+	/* Readahead into the block cache for sequential readers */
+	GThreadPool* 		readahead_pool;
+	guint64 		readahead_min;
+	guint64 		readahead_max;
+
+	/* Head/tail cache for tag scanners */
+	struct MetaCache* 	meta_cache;
+
+	/* stat() results and directory listings for the source */
+	guint 			attr_ttl;
+	guint 			negative_ttl;
+	struct AttrCache* 	attr_cache;
+	struct DirCache* 	dir_cache;
+	struct StatPool* 	stat_pool;
 
 	gint quitflag_atomic;
 	struct WorkitemQueue* work_queue;
 };
 
+/* Tracks how a handle is being read, so we can tell when it's being
+ * streamed and start pulling data in ahead of the reader */
+struct vcachefs_readahead {
+	GStaticMutex 	lock;
+	off_t 		next_offset;
+	guint 		sequential_count;
+	guint64 	window;
+	off_t 		issued_end;
+};
+
 struct vcachefs_fdentry {
 	gint 		refcnt; 
 
 	char* 		relative_path;
-	uint 	 	fd;
 
-	uint64_t 	source_fd;
-	off_t 		source_offset;
+	/* NOTE: These are only ever read with pread(), so there's no offset
+	 * to keep track of. filecache_fd is set atomically once the copy
+	 * lands; if we opened straight from the cache, source_fd is set the
+	 * same way the first time we need it. Neither is closed until the
+	 * last ref goes away */
+	gint 		source_fd;
+	gint 		filecache_fd;
+	int 		open_flags;
 
-	uint64_t 	filecache_fd;
-	off_t 		filecache_offset;
+	struct BlockCacheFile* block_file;
+	struct vcachefs_readahead readahead;
+
+	/* Set until the first read that the head/tail cache can't answer, at
+	 * which point we queue up a copy of the whole file */
+	off_t 		file_size;
+	time_t 		mtime;
+	guint32 	ram_id;
+	gint 		needs_copy;
+	struct MetaCacheEntry* meta_entry;
+
+	/* The copy of this file that's in flight, if we've seen one */
+	struct FillProgress* fill_progress;
 };
 
+/* The guts of the filesystem; the FUSE frontends are thin wrappers
+ * around these. Everything returns 0 or a negative errno */
+struct vcachefs_mount* vcachefs_mount_new(void);
+void vcachefs_mount_free(struct vcachefs_mount* mount_object);
+int vcachefs_mount_getattr(struct vcachefs_mount* mount_obj, const char *path, struct stat *stbuf);
+int vcachefs_mount_open(struct vcachefs_mount* mount_obj, const char *path, int flags, struct vcachefs_fdentry** fde_out);
+gboolean vcachefs_mount_keep_cache(struct vcachefs_mount* mount_obj, struct vcachefs_fdentry* fde);
+int vcachefs_mount_read(struct vcachefs_mount* mount_obj, struct vcachefs_fdentry* fde, 
+		char *buf, size_t size, off_t offset);
+int vcachefs_mount_read_fd(struct vcachefs_mount* mount_obj, struct vcachefs_fdentry* fde, 
+		size_t* size, off_t offset);
+int vcachefs_mount_release(struct vcachefs_mount* mount_obj, struct vcachefs_fdentry* fde);
+int vcachefs_mount_statfs(struct vcachefs_mount* mount_obj, struct statvfs *stat);
+int vcachefs_mount_access(struct vcachefs_mount* mount_obj, const char *path, int amode);
+int vcachefs_mount_readdir(struct vcachefs_mount* mount_obj, const char *path, 
+		DirSnapshotFunc func, gpointer context);
+
+/* lowlevel.c */
+int vcachefs_lowlevel_main(int argc, char *argv[]);
+
 #endif 